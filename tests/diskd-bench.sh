@@ -0,0 +1,460 @@
+#!/bin/sh
+#
+# diskd --- monitors shared disk.
+#   fault injection test bench and detection latency benchmark.
+#
+# diskd runs against a file standing in for the shared disk, behind the
+# LD_PRELOAD shim (diskd_fi.c) which injects the faults and records the
+# attribute updates (fake attrd). For each fault and I/O engine the time
+# to detect it and the time to recover after it is removed are reported;
+# passive monitoring must not take the probes of diskd itself for I/O
+# served by the disk; the status page must read consistent while it is
+# rewritten; the metrics file must hold a well-formed histogram; the
+# ready-fd must get its line once every status is in attrd; a
+# read-only remount must be found without waiting for a write; the
+# health attribute must follow the (mock) health log of the disk; then
+# the CPU and syscall cost of a probe is measured for each I/O engine.
+#
+# Environment:
+#   DISKD        diskd binary
+#   FI_LIB       fault injection shim
+#   BENCH_DIR    work directory (removed afterwards unless BENCH_KEEP=yes)
+#   BENCH_IDLE   seconds of each overhead run. 0 skips the overhead runs.
+#
+# Exit status: 0 every fault was detected and recovered, 1 otherwise,
+# 77 (skip) diskd or the shim is not available, or not run as root.
+
+DISKD=${DISKD:-../tools/diskd}
+FI_LIB=${FI_LIB:-./.libs/libdiskd_fi.so}
+WORK=${BENCH_DIR:-./bench.d}
+IDLE=${BENCH_IDLE:-10}
+
+ATTR=fi_test
+INTERVAL=1		# -i [s]
+TIMEOUT=3		# -t [s]
+SLOW=100		# -L [ms]
+DELAY=400		# injected delay [ms]
+LIMIT=30		# give up waiting for a status after this [s]
+HEALTH=60		# -c [s], the shortest poll of the health logs
+
+if [ ! -x "$DISKD" ] || [ ! -f "$FI_LIB" ]; then
+	echo "diskd ($DISKD) or the shim ($FI_LIB) is not built. skipped."
+	exit 77
+fi
+if [ `id -u` != 0 ]; then
+	echo "diskd runs as root only. skipped."
+	exit 77
+fi
+
+rm -rf "$WORK"
+mkdir -p "$WORK/wdir" || exit 1
+WORK=`cd "$WORK" && pwd`
+DEV="$WORK/disk.img"
+CONTROL="$WORK/fault"
+EVENTS="$WORK/events"
+REPORT="$WORK/report"
+STAT=""			# stat file of the disk (shim), set for passive monitoring
+dd if=/dev/zero of="$DEV" bs=1024 count=1024 2>/dev/null || exit 1
+
+DISKD_PID=""
+failed=0
+
+now() {
+	date +%s.%N
+}
+
+# wait_attr <value> <since> [<attribute> [<limit>]]: print the time of
+# the first update of the attribute ($ATTR) to <value> after <since>
+wait_attr() {
+	end=$((`date +%s` + ${4:-$LIMIT}))
+	while [ `date +%s` -le $end ]; do
+		t=`awk -v n="${3:-$ATTR}" -v v="$1" -v s="$2" \
+			'$2 == "attrd" && $3 == n && $4 == v && $1 > s { print $1; exit }' "$EVENTS" 2>/dev/null`
+		if [ -n "$t" ]; then
+			echo $t
+			return 0
+		fi
+		sleep 0.05
+	done
+	return 1
+}
+
+# start_diskd <fault target> <diskd options>: $COMMON is added
+start_diskd() {
+	target=$1
+	shift
+	: > "$EVENTS"
+	echo "fault=none" > "$CONTROL"
+	rm -f "$WORK/diskd.pid"
+	DISKD_FI_TARGET="$target" DISKD_FI_CONTROL="$CONTROL" DISKD_FI_LOG="$EVENTS" \
+	DISKD_FI_STAT="$STAT" LD_PRELOAD="$FI_LIB" "$DISKD" -a $ATTR -p "$WORK/diskd.pid" "$@" $COMMON \
+		>> "$WORK/diskd.log" 2>&1 &
+	DISKD_PID=$!
+}
+
+stop_diskd() {
+	echo "fault=none" > "$CONTROL"
+	if [ -n "$DISKD_PID" ]; then
+		kill $DISKD_PID 2>/dev/null
+		wait $DISKD_PID 2>/dev/null
+		DISKD_PID=""
+	fi
+}
+
+trap 'stop_diskd; exit 1' INT TERM
+
+diff_time() {
+	awk -v a="$1" -v b="$2" 'BEGIN { printf "%.3f", b - a }'
+}
+
+# wait_metric <pattern>: wait for a line of the metrics file (-x)
+wait_metric() {
+	end=$((`date +%s` + LIMIT))
+	while [ `date +%s` -le $end ]; do
+		grep -q "$1" "$WORK/metrics" 2>/dev/null && return 0
+		sleep 0.5
+	done
+	return 1
+}
+
+# scenario <engine> <target> <fault> <op> <expected status>
+# a corrupted read-back is checked with a verified write (-W), and must be
+# counted as EILSEQ
+scenario() {
+	engine=$1; kind=$2; fault=$3; op=$4; expect=$5
+	detect="-"; recover="-"; result=ok
+	opts=""
+	if [ $fault = corrupt ]; then
+		rm -f "$WORK/metrics"
+		opts="-W -x $WORK/metrics"
+	fi
+
+	if [ $kind = read ]; then
+		start_diskd "$DEV" -E $engine -N "$DEV" $opts
+	else
+		start_diskd "$WORK/wdir" -E $engine -w -d "$WORK/wdir" $opts
+	fi
+	if ! wait_attr normal 0 > /dev/null; then
+		result="FAIL(start)"
+	else
+		sleep $INTERVAL
+		t0=`now`
+		echo "fault=$fault op=$op ms=$DELAY" > "$CONTROL"
+		if t1=`wait_attr $expect $t0`; then
+			detect=`diff_time $t0 $t1`
+			if [ $fault = corrupt ] && ! wait_metric 'diskd_io_errors_total{.*errno="EILSEQ"}'; then
+				result="FAIL(errno)"
+			fi
+			t2=`now`
+			echo "fault=none" > "$CONTROL"
+			if t3=`wait_attr normal $t2`; then
+				recover=`diff_time $t2 $t3`
+			else
+				result="FAIL(recover)"
+			fi
+		else
+			result="FAIL(detect)"
+		fi
+	fi
+	stop_diskd
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		$engine $kind $fault $op $expect $detect $recover $result | tee -a "$REPORT"
+}
+
+# passive <seconds>: with -P and no I/O on the disk but that of diskd,
+# every check must still probe it
+passive() {
+	secs=$1
+	result=ok
+	STAT="$WORK/stat"
+	echo "0 0 0 0 0 0 0 0 0 0 0" > "$STAT"
+	start_diskd "$DEV" -E sync -N "$DEV" -P
+	if ! wait_attr normal 0 > /dev/null; then
+		result="FAIL(start)"
+		probes="-"
+	else
+		t0=`now`
+		sleep $secs
+		probes=`awk -v s="$t0" '$2 == "io" && $3 == "read" && $1 > s { n++ } END { print n + 0 }' "$EVENTS"`
+		# one probe per interval, one may be cut off at each end
+		if [ $probes -lt $((secs / INTERVAL - 2)) ]; then
+			result="FAIL(skipped)"
+		fi
+	fi
+	stop_diskd
+	STAT=""
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		sync read passive idle probes $probes "${secs}s" $result | tee -a "$REPORT"
+}
+
+# statuspage <seconds>: diskd -Q reads a consistent status page (-G)
+# while diskd keeps rewriting it
+statuspage() {
+	secs=$1
+	result=ok
+	reads=0
+	start_diskd "$DEV" -E sync -N "$DEV" -G "$WORK/status" \
+		-T "attr=${ATTR}_2,device=$DEV,interval=1" -T "attr=${ATTR}_3,device=$DEV,interval=1"
+	if ! wait_attr normal 0 > /dev/null; then
+		result="FAIL(start)"
+	else
+		sleep $((INTERVAL * 2))		# the other targets are checked too
+		end=$((`date +%s` + secs))
+		while [ `date +%s` -lt $end ]; do
+			out=`"$DISKD" -Q "$WORK/status" 2>&1`
+			rc=$?
+			reads=$((reads + 1))
+			if [ $rc != 0 ] || [ `echo "$out" | grep -c ' status=normal$'` != 3 ]; then
+				echo "$out" >> "$WORK/status.fail"
+				result="FAIL(read)"
+				break
+			fi
+		done
+	fi
+	stop_diskd
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		sync read page query normal $reads "${secs}s" $result | tee -a "$REPORT"
+}
+
+# metrics: the metrics file (-x) holds the state of the target and a
+# latency histogram with canonical bounds (le="1.0"), cumulative buckets
+# and a +Inf bucket equal to the count
+metrics() {
+	result=ok
+	buckets="-"
+	rm -f "$WORK/metrics"
+	start_diskd "$DEV" -E sync -N "$DEV" -x "$WORK/metrics"
+	if ! wait_attr normal 0 > /dev/null; then
+		result="FAIL(start)"
+	elif ! wait_metric 'diskd_check_latency_seconds_bucket{.*le="1.0"}'; then
+		result="FAIL(written)"
+	elif ! grep -q 'diskd_target_state{.*state="normal"} 1$' "$WORK/metrics"; then
+		result="FAIL(state)"
+	else
+		buckets=`awk '
+			/^diskd_check_latency_seconds_bucket/ {
+				match($1, /le="[^"]*"/)
+				le = substr($1, RSTART + 4, RLENGTH - 5)
+				key = $1
+				sub(/,le="[^"]*"/, "", key)
+				if (le != "+Inf" && le !~ /^[0-9]+\.[0-9]+$/) bad = bad " le=" le
+				if ((key in last) && $2 + 0 < last[key]) bad = bad " decreasing"
+				last[key] = $2 + 0
+				if (le == "+Inf") inf[key] = $2
+				n++
+			}
+			/^diskd_check_latency_seconds_count/ {
+				key = $1
+				sub(/_count/, "_bucket", key)
+				if (inf[key] != $2) bad = bad " count"
+			}
+			END { print (bad == "")? n : "FAIL" bad }' "$WORK/metrics"`
+		case "$buckets" in
+		FAIL*)	result="FAIL(histogram)"
+			echo "$buckets" >> "$WORK/metrics.fail" ;;
+		esac
+	fi
+	stop_diskd
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		sync read metrics file normal buckets "$buckets" $result | tee -a "$REPORT"
+}
+
+# ready: the ready-fd (-y) gets one "READY=1 <attr>=<status>..." line
+# once the first status of every target is in attrd, then is closed
+ready() {
+	result=ok
+	line="-"
+	exec 3> "$WORK/ready"
+	start_diskd "$DEV" -E sync -N "$DEV" -y 3 -T "attr=${ATTR}_2,device=$DEV,interval=1"
+	exec 3>&-
+	end=$((`date +%s` + LIMIT))
+	while [ ! -s "$WORK/ready" ] && [ `date +%s` -le $end ]; do
+		sleep 0.05
+	done
+	if [ ! -s "$WORK/ready" ]; then
+		result="FAIL(line)"
+	else
+		line=`cat "$WORK/ready"`
+		# the order of the targets is not part of it
+		words=`echo $line | tr ' ' '\n' | LC_ALL=C sort | tr '\n' ' '`
+		if [ "$words" != "READY=1 $ATTR=normal ${ATTR}_2=normal " ]; then
+			result="FAIL(line)"
+		elif ! grep -q " attrd ${ATTR}_2 normal$" "$EVENTS" \
+		    || ! grep -q " attrd $ATTR normal$" "$EVENTS"; then
+			result="FAIL(early)"
+		elif [ -e /proc/$DISKD_PID/fd/3 ]; then
+			result="FAIL(open)"
+		fi
+	fi
+	stop_diskd
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		sync read ready fd normal - - $result | tee -a "$REPORT"
+	[ $result = ok ] || echo "$line" >> "$WORK/ready.fail"
+}
+
+# remount: a read-only remount of the file system of a write target is
+# found from the mount table events, and its rw remount recovers
+remount() {
+	detect="-"; recover="-"; result=ok
+	mnt="$WORK/mnt"
+	mkdir -p "$mnt"
+	if ! mount -t tmpfs -o size=1m diskd_bench "$mnt" 2>/dev/null; then
+		printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+			sync write remount ro ERROR - - "SKIP(mount)" | tee -a "$REPORT"
+		return
+	fi
+	start_diskd "$mnt" -E sync -w -d "$mnt"
+	if ! wait_attr normal 0 > /dev/null; then
+		result="FAIL(start)"
+	else
+		sleep $INTERVAL
+		t0=`now`
+		mount -o remount,ro "$mnt"
+		if t1=`wait_attr ERROR $t0`; then
+			detect=`diff_time $t0 $t1`
+			t2=`now`
+			mount -o remount,rw "$mnt"
+			if t3=`wait_attr normal $t2`; then
+				recover=`diff_time $t2 $t3`
+			else
+				result="FAIL(recover)"
+			fi
+		else
+			result="FAIL(detect)"
+		fi
+	fi
+	stop_diskd
+	umount "$mnt"
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		sync write remount ro ERROR $detect $recover $result | tee -a "$REPORT"
+}
+
+# health: with the mock backend (-C mock:<dir>), "<attr>-health" follows
+# the health log of the disk, "ok" then "predicted-failure" at the next
+# poll (-c). The disk is a loop device so that it has a kernel name.
+health() {
+	detect="-"; result=ok
+	loop=`losetup -f --show "$DEV" 2>/dev/null`
+	if [ -z "$loop" ]; then
+		printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+			sync read mock health predicted - - "SKIP(losetup)" | tee -a "$REPORT"
+		return
+	fi
+	mkdir -p "$WORK/health"
+	echo "state=ok temperature=35" > "$WORK/health/`basename $loop`"
+	start_diskd "$loop" -E sync -N "$loop" -C "mock:$WORK/health" -c $HEALTH
+	if ! wait_attr ok 0 ${ATTR}-health > /dev/null; then
+		result="FAIL(start)"
+	else
+		t0=`now`
+		echo "state=failing reason=bench" > "$WORK/health/`basename $loop`"
+		if t1=`wait_attr predicted-failure $t0 ${ATTR}-health $((HEALTH + LIMIT))`; then
+			detect=`diff_time $t0 $t1`
+		else
+			result="FAIL(detect)"
+		fi
+	fi
+	stop_diskd
+	losetup -d "$loop"
+
+	[ $result = ok ] || failed=1
+	printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" \
+		sync read mock health predicted $detect - $result | tee -a "$REPORT"
+}
+
+# cpu time [us] of a process
+cpu_usec() {
+	awk -v hz=`getconf CLK_TCK` '{ printf "%d", ($14 + $15) * 1000000 / hz }' /proc/$1/stat
+}
+
+# overhead <engine> [diskd options]
+overhead() {
+	engine=$1
+	shift
+	start_diskd /nonexistent -N "$DEV" -E $engine "$@"
+	if ! wait_attr normal 0 > /dev/null; then
+		stop_diskd
+		printf "%-6s %-4s %12s %14s\n" $engine "$*" "-" "-" | tee -a "$REPORT"
+		failed=1
+		return
+	fi
+
+	c0=`cpu_usec $DISKD_PID`
+	sleep $IDLE
+	c1=`cpu_usec $DISKD_PID`
+	cpu=`awk -v c=$((c1 - c0)) -v n=$((IDLE / INTERVAL)) 'BEGIN { printf "%.1f", c / n }'`
+
+	calls="-"
+	if command -v strace > /dev/null 2>&1; then
+		strace -c -f -p $DISKD_PID -o "$WORK/strace.$engine" > /dev/null 2>&1 &
+		spid=$!
+		sleep $IDLE
+		kill -INT $spid 2>/dev/null
+		wait $spid 2>/dev/null
+		calls=`awk -v n=$((IDLE / INTERVAL)) \
+			'$NF == "total" { printf "%.1f", $(NF - 2) / n }' "$WORK/strace.$engine" 2>/dev/null`
+		calls=${calls:-"-"}
+	fi
+	stop_diskd
+
+	printf "%-6s %-4s %12s %14s\n" $engine "$*" $cpu $calls | tee -a "$REPORT"
+}
+
+: > "$REPORT"
+COMMON="-i $INTERVAL -t $TIMEOUT -r 0 -e -L $SLOW"
+
+echo "# time to detect / time to recover [s] (interval=${INTERVAL}s timeout=${TIMEOUT}s slow=${SLOW}ms delay=${DELAY}ms)" | tee -a "$REPORT"
+printf "%-6s %-6s %-7s %-6s %-9s %10s %10s  %s\n" engine target fault op expect detect recover result | tee -a "$REPORT"
+# the shim sees the reads and writes of sync and worker, only the open() of aio and uring
+for engine in sync worker aio uring; do
+	for s in \
+		"read eio open ERROR" \
+		"read eio read ERROR" \
+		"read eagain read ERROR" \
+		"read delay read degraded" \
+		"read hang read ERROR" \
+		"write eio open ERROR" \
+		"write eio write ERROR" \
+		"write delay write degraded" \
+		"write hang write ERROR" \
+		"write corrupt read ERROR"
+	do
+		case "$engine $s" in
+		sync*|worker*|*open*)	scenario $engine $s ;;
+		esac
+	done
+done
+passive 8
+statuspage 5
+metrics
+ready
+remount
+health
+
+if [ "$IDLE" -gt 0 ]; then
+	COMMON="-i $INTERVAL -t $TIMEOUT"
+	echo | tee -a "$REPORT"
+	echo "# cost of a probe, ${IDLE}s each (interval=${INTERVAL}s)" | tee -a "$REPORT"
+	printf "%-6s %-4s %12s %14s\n" engine opts "cpu[us]" syscalls | tee -a "$REPORT"
+	for engine in sync aio uring worker; do
+		overhead $engine
+		overhead $engine -k
+	done
+fi
+
+if [ "$BENCH_KEEP" != yes ] && [ $failed = 0 ]; then
+	rm -rf "$WORK"
+fi
+exit $failed
@@ -0,0 +1,447 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   fault injection shim for the test bench (LD_PRELOAD).
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+/*
+ * Environment:
+ *   DISKD_FI_TARGET   faults apply to the paths beginning with this
+ *   DISKD_FI_CONTROL  file holding the fault, re-read on every call:
+ *                       fault=(none|eio|eagain|delay|hang|corrupt) [op=(open|read|write|all)] [ms=<n>]
+ *                     corrupt flips the last byte read (a bad read-back)
+ *   DISKD_FI_LOG      event log, one line per event:
+ *                       <realtime> io <op> <result>
+ *                       <realtime> attrd <name> <value>
+ *   DISKD_FI_STAT     stands in for /sys/dev/block/<dev>/stat (passive
+ *                     monitoring): the I/O on the target is accounted in
+ *                     it, as the kernel would
+ *
+ * attrd_update_delegate() and crm_ipc_new() are replaced as well, so
+ * diskd runs without a cluster and its attribute updates are recorded
+ * in the event log (fake attrd).
+ *
+ * Only the I/O going through libc is seen: the open() of any engine, and
+ * the reads and writes of "-E sync" and "-E worker".
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FI_MAX_FD		4096
+
+#define FI_NONE			0
+#define FI_EIO			1
+#define FI_EAGAIN		2
+#define FI_DELAY		3
+#define FI_HANG			4
+#define FI_CORRUPT		5
+
+#define FI_OP_OPEN		1
+#define FI_OP_READ		2
+#define FI_OP_WRITE		4
+#define FI_OP_ALL		(FI_OP_OPEN | FI_OP_READ | FI_OP_WRITE)
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pread)(int, void *, size_t, off_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+
+static FILE *(*real_fopen)(const char *, const char *);
+static FILE *(*real_fopen64)(const char *, const char *);
+
+static unsigned char fi_fd[FI_MAX_FD];	/* 1: descriptor of the target */
+static unsigned long long fi_ios[2];	/* completed reads, writes */
+
+static void
+fi_init(void)
+{
+	if (real_open != NULL) {
+		return;
+	}
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_write = dlsym(RTLD_NEXT, "write");
+	real_pread = dlsym(RTLD_NEXT, "pread");
+	real_pwrite = dlsym(RTLD_NEXT, "pwrite");
+	real_fopen = dlsym(RTLD_NEXT, "fopen");
+	real_fopen64 = dlsym(RTLD_NEXT, "fopen64");
+	real_open = dlsym(RTLD_NEXT, "open");
+}
+
+static void
+fi_log(const char *fmt, ...)
+{
+	const char *path = getenv("DISKD_FI_LOG");
+	struct timespec ts;
+	char line[512];
+	int len, fd;
+	va_list ap;
+
+	if (path == NULL) {
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	len = snprintf(line, sizeof(line), "%ld.%09ld ", (long)ts.tv_sec, ts.tv_nsec);
+	va_start(ap, fmt);
+	len += vsnprintf(line + len, sizeof(line) - len - 1, fmt, ap);
+	va_end(ap);
+	if (len > (int)sizeof(line) - 2) {
+		len = sizeof(line) - 2;
+	}
+	line[len++] = '\n';
+
+	fd = real_open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		if (real_write(fd, line, len) < 0) {
+			/* nothing to do */
+		}
+		real_close(fd);
+	}
+}
+
+/* Account a completed I/O in the stat file: reads . . ticks writes . . ticks . . . */
+static void
+fi_stat_account(int op)
+{
+	const char *path = getenv("DISKD_FI_STAT");
+	char line[128];
+	int len, fd;
+
+	if (path == NULL || path[0] == '\0') {
+		return;
+	}
+	fi_ios[(op == FI_OP_READ)? 0 : 1]++;
+	len = snprintf(line, sizeof(line), "%llu 0 0 %llu %llu 0 0 %llu 0 0 0\n",
+		fi_ios[0], fi_ios[0], fi_ios[1], fi_ios[1]);
+	fd = real_open(path, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		if (real_write(fd, line, len) < 0) {
+			/* nothing to do */
+		}
+		real_close(fd);
+	}
+}
+
+/* The fault currently set for op */
+static int
+fi_fault(int op, int *ms)
+{
+	const char *path = getenv("DISKD_FI_CONTROL");
+	char spec[256];
+	char *tok, *save = NULL;
+	int fault = FI_NONE;
+	int ops = FI_OP_ALL;
+	ssize_t len;
+	int fd;
+
+	*ms = 0;
+	if (path == NULL || (fd = real_open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		return FI_NONE;
+	}
+	len = real_read(fd, spec, sizeof(spec) - 1);
+	real_close(fd);
+	if (len <= 0) {
+		return FI_NONE;
+	}
+	spec[len] = '\0';
+
+	for (tok = strtok_r(spec, " \t\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\n", &save)) {
+		if (strcmp(tok, "fault=eio") == 0) {
+			fault = FI_EIO;
+		} else if (strcmp(tok, "fault=eagain") == 0) {
+			fault = FI_EAGAIN;
+		} else if (strcmp(tok, "fault=delay") == 0) {
+			fault = FI_DELAY;
+		} else if (strcmp(tok, "fault=hang") == 0) {
+			fault = FI_HANG;
+		} else if (strcmp(tok, "fault=corrupt") == 0) {
+			fault = FI_CORRUPT;
+		} else if (strcmp(tok, "op=open") == 0) {
+			ops = FI_OP_OPEN;
+		} else if (strcmp(tok, "op=read") == 0) {
+			ops = FI_OP_READ;
+		} else if (strcmp(tok, "op=write") == 0) {
+			ops = FI_OP_WRITE;
+		} else if (strncmp(tok, "ms=", 3) == 0) {
+			*ms = atoi(tok + 3);
+		}
+	}
+	return (ops & op)? fault : FI_NONE;
+}
+
+/*
+ * Apply the fault to op. Returns the fault when the real call is to be
+ * made, -1 (with errno) when it fails instead.
+ */
+static int
+fi_inject(int op)
+{
+	int fault;
+	int ms;
+
+	switch ((fault = fi_fault(op, &ms))) {
+		case FI_EIO:
+			errno = EIO;
+			return -1;
+		case FI_EAGAIN:
+			errno = EAGAIN;
+			return -1;
+		case FI_DELAY:
+			usleep(ms * 1000);
+			break;
+		case FI_HANG:
+			/* until the fault is changed */
+			while (fi_fault(op, &ms) == FI_HANG) {
+				usleep(10000);
+			}
+			break;
+	}
+	return fault;
+}
+
+static int
+fi_target_path(const char *path)
+{
+	const char *target = getenv("DISKD_FI_TARGET");
+
+	return target != NULL && path != NULL && strncmp(path, target, strlen(target)) == 0;
+}
+
+static int
+fi_target_fd(int fd)
+{
+	char link[64];
+	char path[4096];
+	ssize_t len;
+
+	if (fd < 0) {
+		return 0;
+	}
+	if (fd < FI_MAX_FD && fi_fd[fd]) {
+		return 1;
+	}
+	/* an I/O worker gets the descriptor from diskd, not through open() */
+	if (getenv("DISKD_FI_TARGET") == NULL) {
+		return 0;
+	}
+	snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+	len = readlink(link, path, sizeof(path) - 1);
+	if (len <= 0) {
+		return 0;
+	}
+	path[len] = '\0';
+	return fi_target_path(path);
+}
+
+static int
+fi_open(const char *path, int flags, mode_t mode)
+{
+	int fd;
+
+	fi_init();
+	if (!fi_target_path(path)) {
+		return real_open(path, flags, mode);
+	}
+
+	if (fi_inject(FI_OP_OPEN) < 0) {
+		fi_log("io open %d", -errno);
+		return -1;
+	}
+	fd = real_open(path, flags, mode);
+	if (fd < 0 && errno == EINVAL && (flags & O_DIRECT)) {
+		/* tmpfs and the like */
+		fd = real_open(path, flags & ~O_DIRECT, mode);
+	}
+	if (fd >= 0 && fd < FI_MAX_FD) {
+		fi_fd[fd] = 1;
+	}
+	fi_log("io open %d", (fd < 0)? -errno : 0);
+	return fd;
+}
+
+int
+open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return fi_open(path, flags, mode);
+}
+
+int
+open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+	return fi_open(path, flags, mode);
+}
+
+int
+close(int fd)
+{
+	fi_init();
+	if (fd >= 0 && fd < FI_MAX_FD) {
+		fi_fd[fd] = 0;
+	}
+	return real_close(fd);
+}
+
+static ssize_t
+fi_io(int op, int fd, void *buf, size_t len, off_t offset, int positional)
+{
+	ssize_t rc;
+	int fault;
+
+	if ((fault = fi_inject(op)) < 0) {
+		rc = -1;
+	} else if (op == FI_OP_READ) {
+		rc = (positional)? real_pread(fd, buf, len, offset) : real_read(fd, buf, len);
+		if (rc > 0 && fault == FI_CORRUPT) {
+			((unsigned char *)buf)[rc - 1] ^= 0xff;
+		}
+	} else {
+		rc = (positional)? real_pwrite(fd, buf, len, offset) : real_write(fd, buf, len);
+	}
+	fi_log("io %s %zd", (op == FI_OP_READ)? "read" : "write", (rc < 0)? (ssize_t)-errno : rc);
+	if (rc >= 0) {
+		fi_stat_account(op);
+	}
+	return rc;
+}
+
+ssize_t
+read(int fd, void *buf, size_t len)
+{
+	fi_init();
+	if (!fi_target_fd(fd)) {
+		return real_read(fd, buf, len);
+	}
+	return fi_io(FI_OP_READ, fd, buf, len, 0, 0);
+}
+
+ssize_t
+write(int fd, const void *buf, size_t len)
+{
+	fi_init();
+	if (!fi_target_fd(fd)) {
+		return real_write(fd, buf, len);
+	}
+	return fi_io(FI_OP_WRITE, fd, (void *)buf, len, 0, 0);
+}
+
+ssize_t
+pread(int fd, void *buf, size_t len, off_t offset)
+{
+	fi_init();
+	if (!fi_target_fd(fd)) {
+		return real_pread(fd, buf, len, offset);
+	}
+	return fi_io(FI_OP_READ, fd, buf, len, offset, 1);
+}
+
+ssize_t
+pread64(int fd, void *buf, size_t len, off_t offset)
+{
+	return pread(fd, buf, len, offset);
+}
+
+ssize_t
+pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	fi_init();
+	if (!fi_target_fd(fd)) {
+		return real_pwrite(fd, buf, len, offset);
+	}
+	return fi_io(FI_OP_WRITE, fd, (void *)buf, len, offset, 1);
+}
+
+ssize_t
+pwrite64(int fd, const void *buf, size_t len, off_t offset)
+{
+	return pwrite(fd, buf, len, offset);
+}
+
+static const char *
+fi_stat_path(const char *path)
+{
+	const char *stat = getenv("DISKD_FI_STAT");
+
+	if (stat != NULL && stat[0] != '\0' && path != NULL && strncmp(path, "/sys/dev/block/", 15) == 0) {
+		return stat;
+	}
+	return path;
+}
+
+FILE *
+fopen(const char *path, const char *mode)
+{
+	fi_init();
+	return real_fopen(fi_stat_path(path), mode);
+}
+
+FILE *
+fopen64(const char *path, const char *mode)
+{
+	fi_init();
+	return real_fopen64(fi_stat_path(path), mode);
+}
+
+/* fake attrd */
+
+void *
+crm_ipc_new(const char *name, size_t max_size)
+{
+	return NULL;
+}
+
+int
+attrd_update_delegate(void *ipc, char command, const char *host, const char *name,
+		      const char *value, const char *section, const char *set,
+		      const char *dampen, const char *user_name, int options)
+{
+	fi_init();
+	fi_log("attrd %s %s", name, (value != NULL)? value : "(null)");
+	return 0;
+}
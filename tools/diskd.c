@@ -32,18 +32,39 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <linux/fs.h>		/* BLKGETSIZE64, BLKSSZGET */
+#ifdef HAVE_SCSI_SG_H
+#  include <scsi/sg.h>
+#endif
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <signal.h>
 #include <time.h>
 #include <string.h>
 
 #include <crm/attrd.h>
 #include <crm/common/mainloop.h>
 
+#include "diskd_health.h"
+#include "diskd_io.h"
+#include "diskd_kevent.h"
+#include "diskd_mount.h"
+#include "diskd_mpath.h"
+#include "diskd_recorder.h"
+#include "diskd_shm.h"
+#include "diskd_stats.h"
+
 #ifdef HAVE_GETOPT_H
 #  include <getopt.h>
 #endif
@@ -56,18 +77,243 @@
 #define MAX_RETRY		10
 #define MIN_RETRY_INTERVAL	1
 #define MAX_RETRY_INTERVAL	3600
+#define MIN_HEARTBEAT		0		/* 0: disabled */
+#define MAX_HEARTBEAT		86400
+#define MIN_HEALTH_INTERVAL	60
+#define MAX_HEALTH_INTERVAL	86400
+#define MAX_ATTRD_BACKOFF	60		/* [s] */
+#define MAX_PROBE_SIZE		(1024 * 1024)	/* [byte] */
+#define MIN_SLOW_THRESHOLD	1		/* [ms] */
+#define MAX_SLOW_THRESHOLD	(MAX_TIMEOUT * 1000)
+#define SLOW_EWMA_ALPHA		0.3		/* weight of the latest check */
+#define MIN_ADAPT_INTERVAL	100		/* [ms] */
+#define ADAPT_HEALTHY_CHECKS	3		/* healthy checks before the interval is doubled */
+#define ADAPT_SPIKE_FACTOR	4		/* latency above this times the average is suspect */
+#define ADAPT_SPIKE_MIN		1000		/* [us] smaller latency is never suspect */
+#define KNAMES_TTL		10		/* [s] kernel names of a target are cached */
+#define KEVENT_GRACE		2		/* [s] kernel events after a check are its own */
+#define MIN_TP_INTERVAL		60		/* [s] between throughput probes */
+#define MAX_TP_SIZE		1024		/* [MiB] per burst */
+#define MAX_TP_BLOCK		1024		/* [KiB] per request */
+#define MAX_TP_DEPTH		32		/* requests in flight */
+#define ERRNO_SLOTS		8		/* errno values counted per target */
+#define METRICS_FILE_INTERVAL	15		/* [s] */
 /* status */
 #define ERROR			1
 #define normal			-1
 #define NONE			2
+#define degraded		3	/* checks succeed, but slowly */
 
 #define WRITE_DATA		64
+#define WRITE_SLOTS		16	/* pages of the preallocated probe file (-k) */
+#define DISKD_BLOCK_MAGIC	"DISKDBLK"
 
 #define WRITE_DIR		"/tmp"
 #define WRITE_FILE		"diskcheck"
 #define PID_FILE		"/tmp/diskd.pid"
+#define QUERY_TIMEOUT		5		/* [s] */
+#define QUERY_NO_ANSWER		2		/* exit status of -Q when diskd does not answer */
+
+#ifndef T_ATTRD
+#  define T_ATTRD		"attrd"
+#endif
+
+#define OPTARGS			"N:wd:a:i:p:DV?t:r:I:oem:T:E:kS:L:l:H:Rz:FMA:X:PKWG:Q:O:j:b:x:f:C:c:y:"
+
+struct diskd_target_s;
+
+/* head of a verified write block (-W), the rest is a pattern */
+typedef struct diskd_block_hdr_s {
+	char magic[8];		/* DISKD_BLOCK_MAGIC */
+	guint64 seq;
+	gint64 stamp;		/* real time [us] */
+	guint64 checksum;	/* FNV-1a of the block with this field 0 */
+} diskd_block_hdr_t;
+
+/* underlying path of a multipath device (-M) */
+typedef struct diskd_path_s {
+	struct diskd_target_s *target;
+	char *name;		/* kernel name, e.g. "sdc" */
+	char *devnode;
+	void *buf;
+	int fd;
+	off_t offset;
+	gboolean healthy;
+	gboolean in_flight;
+	gboolean seen;		/* still listed in sysfs */
+	gint64 start;
+	gint64 last;		/* [us] latency of the last probe */
+	diskd_lat_t lat;
+	ssize_t result;		/* of the probe thread */
+	int err;
+} diskd_path_t;
+
+/* a request slot of the throughput probe */
+typedef struct diskd_tp_slot_s {
+	struct diskd_target_s *target;
+	void *buf;
+} diskd_tp_slot_t;
+
+typedef struct diskd_errno_count_s {
+	int err;		/* -1: all the others */
+	guint64 count;
+} diskd_errno_count_t;
+
+typedef struct diskd_tp_burst_s {
+	gint64 time;		/* monotonic [us] */
+	gint64 bytes;
+} diskd_tp_burst_t;
+
+/* monitored target (read device or write directory) */
+typedef struct diskd_target_s {
+	char *attr_name;	/* node attribute name */
+	char *device;		/* device name for disk check (read) */
+	char *wdir;		/* directory name for disk check (write) */
+	char *wfile;
+	gboolean wflag;
+
+	int interval;		/* -1 : inherit the global value */
+	int timeout;
+	int retry;
+	int retry_interval;
+	int slow_threshold;	/* [ms] 0: degraded state is not used */
+	int slow_clear;		/* [ms] */
+	int min_interval;	/* [ms] adaptive scheduling (-A) */
+	int max_interval;	/* [s] adaptive scheduling (-X) */
+
+	const char *value;	/* current status */
+	gboolean dirty;		/* value is not sent to attrd yet */
+	gboolean first_update;
+	guint timer_id;
+	GSourceFunc check_fn;	/* run by diskd_target_tick() */
+	int cur_interval;	/* [ms] */
+	double phase;		/* [0, 1) of the interval, -1: not aligned */
+	int sched_interval;	/* [ms] cur_interval when next_due was anchored */
+	gint64 next_due;	/* monotonic [us], before jitter */
+	int healthy_checks;	/* in a row, at cur_interval */
+
+	/* watchdog */
+	gint64 wd_deadline;	/* monotonic [us] */
+	int wd_index;		/* position in wd_heap, -1: not running */
 
-#define OPTARGS			"N:wd:a:i:p:DV?t:r:I:oem:"
+	/* descriptor in use; kept across checks with -k */
+	int fd;
+	dev_t st_dev;
+	ino_t st_ino;
+	dev_t st_rdev;
+	int wslot;		/* next write slot of the probe file */
+	off_t woff;		/* offset of the write in progress */
+	void *iobuf;		/* data of the read or write, never looked at */
+	void *vblock;		/* -W: written page, then the page read back */
+	guint64 wseq;		/* -W: sequence number of the last write */
+	gboolean verify_io;	/* -W: the read back is in progress */
+	gboolean direct_off;	/* -W, aio: O_DIRECT is not supported on wdir */
+	guint64 dev_size;	/* [byte] for the random read offset */
+	guint64 rnd_state;
+	guint64 paths_rnd_state;	/* of the path probes (-M), apart from the checks */
+	off_t roff;		/* offset of the last read check */
+	gboolean sg_unsupported;
+
+	/* latency of each phase of the check */
+	diskd_lat_t lat[DISKD_LAT_PHASES];
+	double ewma;		/* [us] of the total latency, < 0: no sample yet */
+	gboolean slow;
+	gboolean spike;		/* the last check was far slower than the average */
+	gint64 last_usec;	/* latency of the last graded check */
+	gint64 check_start;
+	gint64 io_start;
+
+	/* asynchronous check */
+	int attempt;
+	gboolean in_flight;
+	guint retry_id;
+	GAsyncQueue *th_jobs;	/* of the checker thread, NULL: not started */
+	gboolean th_running;	/* the checker thread runs a blocking step of the check */
+	off_t th_offset;	/* of the read with FUA (-F) */
+	ssize_t th_result;	/* of that step, under diskd_lock */
+	int th_err;
+	gboolean wd_expired;	/* set by the watchdog thread, under diskd_lock */
+	gboolean wd_counted;	/* the running attempt is in n_timeouts already, under diskd_lock */
+
+	/* status page entry (-G), written under diskd_lock() */
+	diskd_shm_target_t shm;
+	int shm_index;
+
+	/* passive monitoring (-P) */
+	char *stat_path;	/* I/O statistics of the block device */
+	gboolean passive_off;
+	gboolean p_valid;
+	guint64 p_ios;		/* completed requests at the last sample */
+	guint64 p_ticks;	/* [ms] spent on them */
+	unsigned int p_inflight;
+	double p_service;	/* [ms] average service time since the last sample */
+	gint64 hang_since;	/* in flight without completion since, 0: not */
+
+	/* kernel events (-K) */
+	GList *knames;		/* kernel names of the device, its disk and paths */
+	gint64 knames_time;
+	gint64 kevent_time;	/* last check triggered by a kernel event */
+	gboolean kevent_check;	/* the running check is triggered by one */
+	gint64 check_end;	/* end of the last check */
+
+	/* file system of wdir */
+	dev_t wdir_dev;		/* st_dev at the start, 0: unknown */
+	const char *mount_error;	/* why it is unusable, NULL: usable */
+
+	/* throughput probe (-b) */
+	guint tp_timer_id;
+	void *tp_buf;
+	diskd_tp_slot_t *tp_slots;
+	char *tp_file;		/* "<wfile>-throughput" */
+	int tp_fd;
+	gboolean tp_running;
+	gboolean tp_failed;
+	gboolean tp_slow;	/* below the floor at the last burst */
+	off_t tp_next;
+	off_t tp_end;
+	int tp_inflight;
+	gint64 tp_start;
+	gint64 tp_bytes;
+	gint64 tp_done;		/* requests */
+	double tp_mbps;
+	double tp_iops;
+	GList *tp_history;	/* diskd_tp_burst_t of the last hour, oldest first */
+
+	/* flight recorder */
+	gint32 lat_last[DISKD_LAT_PHASES];	/* [us] of the running attempt, -1: not run */
+
+	/* counters (metrics) */
+	guint64 n_checks;
+	guint64 n_failures;
+	guint64 n_retries;
+	guint64 n_timeouts;	/* under diskd_lock */
+	guint64 n_transitions;	/* under diskd_lock */
+	guint64 n_attrd_failures;	/* under diskd_lock */
+	diskd_errno_count_t n_errnos[ERRNO_SLOTS];
+
+	/* multipath paths (-M) */
+	GList *paths;		/* list of diskd_path_t */
+	char *paths_attr;	/* "<attr_name>-paths" */
+	char paths_value[32];	/* "<healthy>/<total>" */
+	gboolean paths_dirty;
+	gboolean paths_first_update;
+
+	/* health logs of the disks (-C) */
+	char *health_attr;	/* "<attr_name>-health" */
+	char health_value[24];	/* "ok" or "predicted-failure", "": not known yet */
+	gboolean health_dirty;
+	gboolean health_first_update;
+	diskd_health_t health;	/* worst of the disks */
+} diskd_target_t;
+
+/* health log poll of a target, run in a thread (-C) */
+typedef struct diskd_health_job_s {
+	diskd_target_t *target;	/* used on the main loop only */
+	GList *names;		/* kernel names of the disks */
+	diskd_health_t health;
+} diskd_health_job_t;
+
+#define target_name(t)		((t)->wflag ? (t)->wdir : (t)->device)
 
 GMainLoop* mainloop = NULL;
 const char *diskd_attr = "diskd";
@@ -76,21 +322,52 @@ const char *attr_set = NULL;
 const char *attr_dampen = "0";
 
 const char *device = NULL;	/* device name for disk check */
-const char *wdir = NULL;
-char *wfile = NULL;		/* directory name for disk check (write) 2008.10.24 */
+const char *wdir = NULL;	/* directory name for disk check (write) 2008.10.24 */
 gboolean wflag = FALSE;
 int optflag = 0;		/* flag for duplicate */
 
+GList *targets = NULL;		/* list of diskd_target_t */
+
 int retry = 1;			/* disk check retry. default 1 times */
 int retry_interval = 5;		/* disk check retry intarval time. default 5sec. */
+int heartbeat = 0;		/* resend unchanged values to attrd every heartbeat sec. default disabled. */
+int slow_threshold = 0;		/* degraded above this latency [ms]. default disabled. */
+int slow_clear = -1;		/* normal again below this latency [ms]. default 80% of slow_threshold. */
 int interval = 30;		/* disk check interval. default 30sec.*/
+int min_interval = -1;		/* adaptive scheduling floor [ms]. default interval (disabled). */
+int max_interval = -1;		/* adaptive scheduling ceiling [s]. default interval. */
+int phase_slot = 0;		/* -O <slot>/<count> */
+int phase_count = 0;		/* 0: phase from the node name, -1: none */
+int jitter = 0;			/* [ms] */
+int throughput_flag = 0;
+int tp_interval = 3600;		/* [s] */
+gint64 tp_size = 64 * 1024 * 1024;	/* [byte] per burst */
+int tp_block = 1024 * 1024;	/* [byte] per request */
+int tp_depth = 4;
+int tp_duration = 5;		/* [s] */
+int tp_min_mbps = 0;
+int tp_min_iops = 0;
+gint64 tp_budget = 256 * 1024 * 1024;	/* [byte] per hour */
 int timeout = 60;		/* disk check read func timeout. default 60sec. */
 int oneshot_flag = 0;
 int exec_thread_flag = 0;
-const char *diskcheck_value = NULL;
+int keep_open_flag = 0;
+int random_offset_flag = 0;
+int bypass_cache_flag = 0;
+int probe_size = 0;		/* read size of the disk check. default pagesize. */
+int multipath_flag = 0;
+int passive_flag = 0;
+int kevent_flag = 0;
+int verify_flag = 0;
+int health_flag = 0;
+int health_interval = 1800;	/* [s] poll of the health logs */
+int ready_fd = -1;		/* readiness line written here (-y) */
+const char *stats_socket = NULL;
+const char *status_file = NULL;
+const char *metrics_file = NULL;
+char *recorder_file = NULL;	/* default <pid_file>.flight */
+int io_engine = DISKD_IO_AUTO;
 int pagesize = 0;
-void *ptr = NULL;
-void *buf;
 
 #if PACEMAKER_GE_1113
 int attr_options = attrd_opt_none;
@@ -101,37 +378,86 @@ gboolean attr_options = FALSE;
 #if GLIB_CHECK_VERSION(2, 32, 0)
 GMutex diskd_mutex;
 GCond diskd_cond;
-GMutex thread_start_mutex;
-GCond thread_start_cond;
 #else
 static GMutex *diskd_mutex = NULL;		/* Thread Mutex */
 static GCond *diskd_cond = NULL;		/* Thread Cond */
-static GMutex *thread_start_mutex = NULL;	/* Thread Start Mutex */
-static GCond *thread_start_cond = NULL;		/* Thread Start Cond */
 #endif
 static gboolean diskd_thread_use = FALSE;	/* Tthred Timer Flag */
-static GThread *th_timer = NULL;		/* Thread Timer */
-static int timer_id = -1;
-
-static void diskd_thread_timer_init(void);
-static void diskd_thread_create(void);
-static void diskd_thread_timer_variable_free(void);
-static void diskd_thread_condsend(void);
-static void diskd_thread_timer_end(void);
-void send_update(void);
+static GThread *th_watchdog = NULL;		/* Watchdog Thread */
+static diskd_target_t **wd_heap = NULL;		/* running checks, earliest deadline first */
+static int wd_heap_len = 0;
+static gboolean wd_stop = FALSE;
+
+/* attrd connection kept open across updates */
+static crm_ipc_t *attrd_ipc = NULL;
+static crm_trigger_t *attrd_trigger = NULL;
+static guint attrd_retry_id = 0;
+static int attrd_backoff = 0;			/* [s] */
+static guint heartbeat_id = 0;
+static guint metrics_id = 0;
+static guint health_id = 0;
+static gboolean health_running = FALSE;
+static gboolean ready_sent = FALSE;
+static crm_trigger_t *recorder_trigger = NULL;
+static const char *recorder_reason = NULL;
+
+static void diskd_lock(void);
+static void diskd_unlock(void);
+static void diskd_watchdog_init(void);
+static void diskd_watchdog_arm(diskd_target_t *target);
+static void diskd_watchdog_disarm(diskd_target_t *target);
+static void diskd_watchdog_variable_free(void);
+static void diskd_watchdog_end(void);
+static gpointer diskd_watchdog_func(gpointer data);
+static int send_update(diskd_target_t *target, crm_ipc_t *ipc);
+static int send_paths_update(diskd_target_t *target, crm_ipc_t *ipc);
+static int send_health_update(diskd_target_t *target, crm_ipc_t *ipc);
+static int diskd_attrd_flush(gpointer data);
+static gboolean diskd_attrd_heartbeat(gpointer data);
+static void diskd_attrd_disconnect(void);
+static void diskd_notify(const char *state);
 void crm_make_daemon(const char *name, gboolean daemonize, const char *pidfile);
 
 static void
 diskd_shutdown(int nsig)
 {
+	GList *gIter;
+
 	crm_info("Exiting");
+	diskd_notify("STOPPING=1");
 
-	if (timer_id != -1) {
-		g_source_remove(timer_id);
-		timer_id = -1;
-	}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
 
-	diskd_thread_condsend();
+		if (target->timer_id != 0) {
+			g_source_remove(target->timer_id);
+			target->timer_id = 0;
+		}
+		if (target->retry_id != 0) {
+			g_source_remove(target->retry_id);
+			target->retry_id = 0;
+		}
+		if (target->tp_timer_id != 0) {
+			g_source_remove(target->tp_timer_id);
+			target->tp_timer_id = 0;
+		}
+	}
+	if (metrics_id != 0) {
+		g_source_remove(metrics_id);
+		metrics_id = 0;
+	}
+	if (health_id != 0) {
+		g_source_remove(health_id);
+		health_id = 0;
+	}
+	if (heartbeat_id != 0) {
+		g_source_remove(heartbeat_id);
+		heartbeat_id = 0;
+	}
+	if (attrd_retry_id != 0) {
+		g_source_remove(attrd_retry_id);
+		attrd_retry_id = 0;
+	}
 
 	if (mainloop != NULL && g_main_is_running(mainloop)) {
 		g_main_quit(mainloop);
@@ -146,7 +472,7 @@ usage(const char *cmd, int crm_exit_status)
 	FILE *stream;
 	stream = crm_exit_status ? stderr : stdout;
 
-	fprintf(stream, "usage: %s (-N|-w) [-daipDV?trIoem]\n", cmd);
+	fprintf(stream, "usage: %s (-N|-w|-T) [-daipDV?trIoemT]\n", cmd);
 	fprintf(stream, "\nBasic options\n");
 	fprintf(stream, "    --%s (-%c) <device>\tDevice name to read\n"
 		"\t\t\t\t\t * Required option\n", "read-device-name", 'N');
@@ -168,7 +494,64 @@ usage(const char *cmd, int crm_exit_status)
 		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "exec-thread", 'e');
 	fprintf(stream, "    --%s (-%c) <time[s]>\t\tDampening interval\n"
 		"\t\t\t\t\t * Default=0 sec.\n", "dampen", 'm');
+	fprintf(stream, "    --%s (-%c)\t\t\tKeep the device or probe file open between checks\n"
+		"\t\t\t\t\t * The write check overwrites a preallocated file in place\n", "keep-open", 'k');
+	fprintf(stream, "    --%s (-%c) <path>\t\tUNIX socket reporting the check latency\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "stats-socket", 'S');
+	fprintf(stream, "    --%s (-%c) <path>\t\tAsk the diskd listening on <path> (-S) for the status\n"
+		"\t\t\t\t\t of its targets, print it and exit\n"
+		"\t\t\t\t\t * <path> may be its status file (-G) instead\n"
+		"\t\t\t\t\t * Exit status: 0=all normal or degraded, 1=ERROR or unknown,\n"
+		"\t\t\t\t\t   %d=no answer\n", "query", 'Q', QUERY_NO_ANSWER);
+	fprintf(stream, "    --%s (-%c) <path>\tRewrite the counters and the latency histograms in\n"
+		"\t\t\t\t\t the Prometheus text format every %d sec.\n"
+		"\t\t\t\t\t (for the textfile collector, e.g. <dir>/diskd.prom)\n"
+		"\t\t\t\t\t The stats socket (-S) answers \"metrics\" in OpenMetrics\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "metrics-file", 'x',
+		METRICS_FILE_INTERVAL);
+	fprintf(stream, "    --%s (-%c) <path>\tKeep the last %d checks in memory and write them to\n"
+		"\t\t\t\t\t <path> when a target changes to ERROR and on SIGUSR1\n"
+		"\t\t\t\t\t (the previous dump is kept as <path>.1)\n"
+		"\t\t\t\t\t * none: disabled. Default=<pid-file>.flight\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n",
+		"flight-recorder", 'f', DISKD_RECORDER_SIZE);
+	fprintf(stream, "    --%s (-%c) <path>\t\tPublish the status of the targets in a mmap'd file\n"
+		"\t\t\t\t\t (e.g. /run/diskd.status)\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "status-file", 'G');
+	fprintf(stream, "    --%s (-%c)\t\tRead from a random offset of the whole device\n", "random-offset", 'R');
+	fprintf(stream, "    --%s (-%c) <bytes>\t\tRead size of the disk check (multiple of the page size)\n"
+		"\t\t\t\t\t * Default=page size\n", "probe-size", 'z');
+	fprintf(stream, "    --%s (-%c)\t\tRead with FUA (SCSI READ(16) by SG_IO) to bypass the array cache\n", "bypass-cache", 'F');
+	fprintf(stream, "    --%s (-%c)\t\tAlso check each path of a multipath device,\n"
+		"\t\t\t\t\t and set <attr_name>-paths to <healthy>/<total>\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "multipath", 'M');
+	fprintf(stream, "    --%s (-%c)\t\t\tJudge from the I/O statistics of the disk while it is busy,\n"
+		"\t\t\t\t\t and check it only when it is idle\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "passive", 'P');
+	fprintf(stream, "    --%s (-%c)\t\tCheck at once on a kernel report (kmsg, uevent)\n"
+		"\t\t\t\t\t about the disk\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "kernel-events", 'K');
+	fprintf(stream, "    --%s (-%c) <backend>\tRead the health log (SMART, NVMe) of the disks and set\n"
+		"\t\t\t\t\t <attr_name>-health to \"ok\" or \"predicted-failure\"\n"
+		"\t\t\t\t\t * backend: auto|nvme|ata|scsi|mock:<dir>\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "health-log", 'C');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tInterval of the health log poll\n"
+		"\t\t\t\t\t * Default=1800\n", "health-interval", 'c');
+	fprintf(stream, "    --%s (-%c)\t\tWrite a stamped page with O_DIRECT and verify it by reading\n"
+		"\t\t\t\t\t it back (write check)\n", "verify-write", 'W');
+	fprintf(stream, "    --%s (-%c) <fd>\t\tWrite \"READY=1 <attr_name>=<status>...\" to this descriptor\n"
+		"\t\t\t\t\t and close it once the first status of every target\n"
+		"\t\t\t\t\t is in attrd (also sent to $NOTIFY_SOCKET when set)\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "ready-fd", 'y');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tResend unchanged status to attrd at this interval\n"
+		"\t\t\t\t\t * Default=0 (only changes are sent)\n", "heartbeat", 'H');
 	fprintf(stream, "    --%s (-%c)\t\t\t\tThis text\n", "help", '?');
+	fprintf(stream, "    --%s (-%c) <spec>\t\tAdditional target to check (may be repeated)\n"
+		"\t\t\t\t\t * spec: attr=<name>,(device=<device>|write-dir=<directory>)\n"
+		"\t\t\t\t\t   [,interval=<s>][,timeout=<s>][,retry=<n>][,retry-interval=<s>]\n"
+		"\t\t\t\t\t   [,slow-threshold=<ms>][,slow-clear=<ms>]\n"
+		"\t\t\t\t\t   [,min-interval=<ms>][,max-interval=<s>]\n"
+		"\t\t\t\t\t * Unspecified values are taken from -i, -t, -r, -I\n", "target", 'T');
 	fprintf(stream, "\nNote: -N, -w options cannot be specified at the same time.\n\n");
 	fprintf(stream, "Advanced options\n");
 	fprintf(stream, "    --%s (-%c) <time[s]>\tDisk status check timeout for select function\n"
@@ -177,65 +560,219 @@ usage(const char *cmd, int crm_exit_status)
 		"\t\t\t\t\t * Default=1 times\n", "retry", 'r');
 	fprintf(stream, "    --%s (-%c) <time[s]>\tDisk status check retry interval time\n"
 		"\t\t\t\t\t * Default=5 sec.\n", "retry-interval", 'I');
+	fprintf(stream, "    --%s (-%c) <time[ms]>\tSet \"degraded\" when the average check latency exceeds it\n"
+		"\t\t\t\t\t * Default=0 (disabled)\n", "slow-threshold", 'L');
+	fprintf(stream, "    --%s (-%c) <time[ms]>\tSet \"normal\" again when the average falls below it\n"
+		"\t\t\t\t\t * Default=80%% of slow-threshold\n", "slow-clear", 'l');
+	fprintf(stream, "    --%s (-%c) <time[ms]>\tShortest check interval, used while a target is suspect\n"
+		"\t\t\t\t\t (error, retry, latency spike or degraded)\n"
+		"\t\t\t\t\t * Default=interval (adaptive scheduling disabled)\n", "min-interval", 'A');
+	fprintf(stream, "    --%s (-%c) <time[s]>\tLongest check interval, reached after sustained health\n"
+		"\t\t\t\t\t * Default=interval\n", "max-interval", 'X');
+	fprintf(stream, "    --%s (-%c) <spec>\t\tPhase of the checks within the interval, so that\n"
+		"\t\t\t\t\t the nodes do not check the shared disk at the same time\n"
+		"\t\t\t\t\t * auto: derived from the node name\n"
+		"\t\t\t\t\t * <n>/<N>: slot n (modulo N) of N, e.g. the node ID and\n"
+		"\t\t\t\t\t   the number of nodes, for an even spread\n"
+		"\t\t\t\t\t * none: from the start of diskd. Default=auto\n", "phase", 'O');
+	fprintf(stream, "    --%s (-%c) <time[ms]>\t\tDelay each check by a random time up to this\n"
+		"\t\t\t\t\t (at most a quarter of the interval)\n"
+		"\t\t\t\t\t * Default=0\n", "jitter", 'j');
+	fprintf(stream, "    --%s (-%c) <spec>\t\tPeriodic sequential burst, \"degraded\" below a floor\n"
+		"\t\t\t\t\t (read of the device, write of <wdir>/%s-throughput)\n"
+		"\t\t\t\t\t * spec: (min-mbps=<MB/s>|min-iops=<n>)[,interval=<s>]\n"
+		"\t\t\t\t\t   [,size=<MiB>][,block=<KiB>][,depth=<n>][,duration=<s>]\n"
+		"\t\t\t\t\t   [,budget=<MiB per hour>]\n"
+		"\t\t\t\t\t * Default: interval=3600,size=64,block=1024,depth=4,\n"
+		"\t\t\t\t\t   duration=5,budget=256\n"
+		"\t\t\t\t\t * Needs an asynchronous I/O engine (-E)\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "throughput", 'b', WRITE_FILE);
+	fprintf(stream, "    --%s (-%c) <engine>\t\tI/O engine for the disk check\n"
+		"\t\t\t\t\t * auto, uring, aio, worker or sync. Default=auto\n"
+		"\t\t\t\t\t * Invalid at the time of the oneshot parameter designation\n", "io-engine", 'E');
 
 	fflush(stream);
 	crm_exit(crm_exit_status);
 }
 
+/*
+ * Set the status of a target. Only a changed value is sent to attrd; the
+ * values changed while the main loop runs a check are sent together by
+ * diskd_attrd_flush().
+ */
 static gboolean
-check_status(int new_status)
+check_status(diskd_target_t *target, int new_status)
 {
+	const char *old_value;
+
 	if (oneshot_flag) { /* oneshot */
 		return FALSE;
 	}
 
-	if (new_status != ERROR && new_status != normal) {
+	if (new_status != ERROR && new_status != normal && new_status != degraded) {
 		crm_warn("non-defined status, new_status = %d", new_status);
 		return FALSE;
 	}
 
-	if (diskd_thread_use == TRUE) {
-#if GLIB_CHECK_VERSION(2, 32, 0)
-		g_mutex_lock(&diskd_mutex);
-#else
-		g_mutex_lock(diskd_mutex);
-#endif
-	}
+	diskd_lock();
 
+	old_value = target->value;
 	if (new_status == ERROR) {
-		diskcheck_value = "ERROR";
+		target->value = "ERROR";
 		crm_warn("disk status is changed, attr_name=%s, target=%s, new_status=%s",
-			diskd_attr, (wflag)? wdir : device, diskcheck_value);
+			target->attr_name, target_name(target), target->value);
+	} else if (new_status == degraded) {
+		target->value = "degraded";
 	} else {
-		diskcheck_value = "normal";
+		target->value = "normal";
 	}
-	send_update();
+	if (old_value == NULL || strcmp(old_value, target->value) != 0) {
+		if (old_value != NULL) {
+			target->n_transitions++;
+		}
+		if (new_status == ERROR && recorder_trigger != NULL) {
+			recorder_reason = "a target has changed to ERROR";
+			mainloop_set_trigger(recorder_trigger);
+		}
+		target->dirty = TRUE;
+		if (attrd_trigger != NULL) {
+			mainloop_set_trigger(attrd_trigger);
+		}
+	}
+	if (status_file != NULL) {
+		g_strlcpy(target->shm.status, target->value, sizeof(target->shm.status));
+		diskd_shm_update(target->shm_index, &target->shm);
+	}
+
+	diskd_unlock();
+
+	if (target->dirty && attrd_trigger == NULL) {
+		/* no main loop yet */
+		send_update(target, NULL);
+	}
+	return TRUE;
+}
+
+static void diskd_lock(void)
+{
+	if (diskd_thread_use == FALSE) return;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_lock(&diskd_mutex);
+#else
+	g_mutex_lock(diskd_mutex);
+#endif
+}
+
+static void diskd_unlock(void)
+{
+	if (diskd_thread_use == FALSE) return;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+	g_mutex_unlock(&diskd_mutex);
+#else
+	g_mutex_unlock(diskd_mutex);
+#endif
+}
+
+/* Run func(data) in a detached thread. FALSE: it could not be created. */
+static gboolean diskd_thread_start(const char *name, GThreadFunc func, gpointer data)
+{
+	GThread *th;
+	GError *gerr = NULL;
 
-	if (diskd_thread_use == TRUE) {
 #if GLIB_CHECK_VERSION(2, 32, 0)
-		g_mutex_unlock(&diskd_mutex);
+	th = g_thread_try_new(name, func, data, &gerr);
+	if (th != NULL) {
+		g_thread_unref(th);
+	}
 #else
-		g_mutex_unlock(diskd_mutex);
+	if (!g_thread_supported()) {
+		g_thread_init(NULL);
+	}
+	th = g_thread_create(func, data, FALSE, &gerr);
 #endif
+	if (th == NULL) {
+		crm_err("Cannot create the %s thread. %s", name, gerr->message);
+		g_error_free(gerr);
+		return FALSE;
 	}
 	return TRUE;
 }
 
-static void diskd_thread_timer_init()
+/*
+ * Deadline heap of the watchdog: a binary min-heap of the targets whose
+ * check is running, ordered by wd_deadline. Called with diskd_mutex held.
+ */
+static void wd_heap_swap(int a, int b)
+{
+	diskd_target_t *tmp = wd_heap[a];
+
+	wd_heap[a] = wd_heap[b];
+	wd_heap[b] = tmp;
+	wd_heap[a]->wd_index = a;
+	wd_heap[b]->wd_index = b;
+}
+
+static void wd_heap_up(int i)
+{
+	while (i > 0 && wd_heap[(i - 1) / 2]->wd_deadline > wd_heap[i]->wd_deadline) {
+		wd_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void wd_heap_down(int i)
+{
+	int min, l, r;
+
+	while (1) {
+		min = i;
+		l = 2 * i + 1;
+		r = l + 1;
+		if (l < wd_heap_len && wd_heap[l]->wd_deadline < wd_heap[min]->wd_deadline) min = l;
+		if (r < wd_heap_len && wd_heap[r]->wd_deadline < wd_heap[min]->wd_deadline) min = r;
+		if (min == i) return;
+		wd_heap_swap(i, min);
+		i = min;
+	}
+}
+
+static void wd_heap_remove(diskd_target_t *target)
+{
+	int i = target->wd_index;
+
+	if (i < 0) return;
+
+	wd_heap_len--;
+	if (i != wd_heap_len) {
+		wd_heap_swap(i, wd_heap_len);
+		wd_heap_down(i);
+		wd_heap_up(i);
+	}
+	target->wd_index = -1;
+}
+
+static void diskd_watchdog_init()
 {
+	GError *gerr = NULL;
+
 	if (exec_thread_flag == 0) return;
 
+	wd_heap = calloc(g_list_length(targets), sizeof(diskd_target_t *));
+	if (wd_heap == NULL) {
+		crm_warn("Could not allocate memory. The thread timer is not available.");
+		return;
+	}
+
 #if GLIB_CHECK_VERSION(2, 32, 0)
 	/*
 	 * When g_mutex_init() and g_cond_init() fails, it will call abort().
 	 * https://git.gnome.org/browse/glib/tree/glib/gthread-posix.c?h=glib-2-32
 	 */
-	g_mutex_init(&thread_start_mutex);
-	g_cond_init(&thread_start_cond);
 	g_mutex_init(&diskd_mutex);
 	g_cond_init(&diskd_cond);
 
 	diskd_thread_use = TRUE;
+	th_watchdog = g_thread_try_new(NULL, diskd_watchdog_func, NULL, &gerr);
 #else
 	if (g_thread_supported()) {
 		crm_warn("The thread timer of diskd is not supported. By this system,"
@@ -243,365 +780,2882 @@ static void diskd_thread_timer_init()
 		return;
 	}
 	g_thread_init(NULL);
-	thread_start_mutex = g_mutex_new();
-	thread_start_cond = g_cond_new();
 	diskd_mutex = g_mutex_new();
 	diskd_cond = g_cond_new();
 
-	if (diskd_mutex && diskd_cond && thread_start_mutex && thread_start_cond) {
-		diskd_thread_use = TRUE;
-	} else {
-		diskd_thread_timer_variable_free();
+	if (diskd_mutex == NULL || diskd_cond == NULL) {
+		diskd_watchdog_variable_free();
 		crm_warn("Failed in the generation of the thread variable."
 			" The thread timer is not available.");
+		return;
 	}
+	diskd_thread_use = TRUE;
+	th_watchdog = g_thread_create(diskd_watchdog_func, NULL, TRUE, &gerr);
 #endif
+
+	if (th_watchdog == NULL) {
+		crm_err("Cannot create diskd watchdog thread. %s", gerr->message);
+		g_error_free(gerr);
+		diskd_thread_use = FALSE;
+		diskd_watchdog_variable_free();
+	}
 }
 
-static void diskd_thread_timer_variable_free()
+static void diskd_watchdog_variable_free()
 {
 #if GLIB_CHECK_VERSION(2, 32, 0)
 	g_mutex_clear(&diskd_mutex);
-	g_mutex_clear(&thread_start_mutex);
 	g_cond_clear(&diskd_cond);
-	g_cond_clear(&thread_start_cond);
 #else
 	if (diskd_mutex != NULL) {
 		g_mutex_free(diskd_mutex);
 		diskd_mutex = NULL;
 	}
-	if (thread_start_mutex != NULL) {
-		g_mutex_free(thread_start_mutex);
-		thread_start_mutex = NULL;
-	}
 	if (diskd_cond != NULL) {
 		g_cond_free(diskd_cond);
 		diskd_cond = NULL;
 	}
-	if (thread_start_cond != NULL) {
-		g_cond_free(thread_start_cond);
-		thread_start_cond = NULL;
-	}
 #endif
+	free(wd_heap);
+	wd_heap = NULL;
+	wd_heap_len = 0;
 }
 
-static void diskd_thread_timer_end()
-{
-	if (diskd_thread_use == FALSE) return;
-
-	diskd_thread_timer_variable_free();
-}
-
-static void diskd_thread_condsend()
+static void diskd_watchdog_end()
 {
 	gpointer ret_thread;
 
 	if (diskd_thread_use == FALSE) return;
 
+	diskd_lock();
+	wd_stop = TRUE;
 #if GLIB_CHECK_VERSION(2, 32, 0)
-	g_mutex_lock(&diskd_mutex);
 	g_cond_broadcast(&diskd_cond);
-	g_mutex_unlock(&diskd_mutex);
 #else
-	if (diskd_mutex == NULL || diskd_cond == NULL) {
-		crm_warn("Cannot transmit cond to a thread");
-		return;
-	}
-	g_mutex_lock(diskd_mutex);
 	g_cond_broadcast(diskd_cond);
-	g_mutex_unlock(diskd_mutex);
 #endif
+	diskd_unlock();
 
-	if (th_timer != NULL) {
-		ret_thread = g_thread_join(th_timer);
-		crm_trace("thread_join -> %d", GPOINTER_TO_INT(ret_thread));
-		th_timer = NULL;
-	}
+	ret_thread = g_thread_join(th_watchdog);
+	crm_trace("thread_join -> %d", GPOINTER_TO_INT(ret_thread));
+	th_watchdog = NULL;
+	diskd_thread_use = FALSE;
+
+	diskd_watchdog_variable_free();
 }
 
-static void diskd_thread_timer_func(gpointer data)
+/* The check of target has begun, it must end within target->timeout */
+static void diskd_watchdog_arm(diskd_target_t *target)
 {
-	gboolean bret;
+	if (diskd_thread_use == FALSE) return;
 
+	diskd_lock();
+	wd_heap_remove(target);
+	target->wd_deadline = g_get_monotonic_time() + target->timeout * G_TIME_SPAN_SECOND;
+	target->wd_index = wd_heap_len;
+	wd_heap[wd_heap_len++] = target;
+	wd_heap_up(target->wd_index);
+	if (target->wd_index == 0) {
+		/* the earliest deadline is changed */
 #if GLIB_CHECK_VERSION(2, 32, 0)
-	gint64 end_time;
-
-	g_mutex_lock(&thread_start_mutex);
-
-	/* Awaiting a start */
-	g_mutex_lock(&diskd_mutex);
-
-	/* A calculation of the waiting time */
-	end_time = g_get_monotonic_time() + timeout * G_TIME_SPAN_SECOND;
-
-	g_cond_signal(&thread_start_cond);
-
-	g_mutex_unlock(&thread_start_mutex);
-
-	bret = g_cond_wait_until(&diskd_cond, &diskd_mutex, end_time);
-	g_mutex_unlock(&diskd_mutex);
+		g_cond_signal(&diskd_cond);
 #else
-	GTimeVal gtime;
-	glong add_time = (timeout) * 1000 * 1000;
-
-	g_mutex_lock(thread_start_mutex);
+		g_cond_signal(diskd_cond);
+#endif
+	}
+	diskd_unlock();
+}
 
-	/* Awaiting a start */
-	g_mutex_lock(diskd_mutex);
+/* The check of target has ended */
+static void diskd_watchdog_disarm(diskd_target_t *target)
+{
+	if (diskd_thread_use == FALSE) return;
 
-	/* A calculation of the waiting time and practice of the timer.(mergin 1s) */
-	g_get_current_time(&gtime);
-	g_time_val_add(&gtime, add_time);
+	diskd_lock();
+	wd_heap_remove(target);
+	diskd_unlock();
+}
 
-	g_cond_signal(thread_start_cond);
+/* Set ERROR on the targets whose check has passed its deadline */
+static gboolean diskd_watchdog_expired(gpointer data)
+{
+	GList *gIter;
+	gboolean expired;
 
-	g_mutex_unlock(thread_start_mutex);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
 
-	bret = g_cond_timed_wait(diskd_cond, diskd_mutex, &gtime);
-	g_mutex_unlock(diskd_mutex);
-#endif
+		diskd_lock();
+		expired = target->wd_expired;
+		target->wd_expired = FALSE;
+		diskd_unlock();
 
-	if (bret == FALSE){
-		crm_warn("Timeout Error(s) occurred in diskd timer thread.");
-		check_status(ERROR);
-		g_thread_exit(GINT_TO_POINTER(ERROR));
+		if (expired) {
+			crm_warn("Timeout Error(s) occurred in diskd timer thread. attr_name=%s",
+				target->attr_name);
+			check_status(target, ERROR);
+		}
 	}
-	crm_trace("Received Cond from Main().");
-	g_thread_exit(GINT_TO_POINTER(normal));
+	return FALSE;
 }
 
-static void diskd_thread_create()
+/*
+ * The watchdog thread sleeps until the earliest deadline of the running
+ * checks and flags a target whose check has not ended by then; the main
+ * loop sets it to ERROR (diskd_watchdog_expired).
+ */
+static gpointer diskd_watchdog_func(gpointer data)
 {
-	GError *gerr = NULL;
-
-	if (diskd_thread_use == FALSE) return;
+	diskd_target_t *target;
+	gint64 now;
 
+	diskd_lock();
+	while (wd_stop == FALSE) {
+		if (wd_heap_len == 0) {
 #if GLIB_CHECK_VERSION(2, 32, 0)
-	g_mutex_lock(&thread_start_mutex);
-
-	if (th_timer == NULL) {
-		th_timer = g_thread_try_new(NULL, (GThreadFunc)diskd_thread_timer_func, NULL, &gerr);
-		if (th_timer == NULL) {
-			crm_err("Cannot create diskd timer_thread. %s", gerr->message);
-			g_error_free(gerr);
-			diskd_thread_use = FALSE;
-			g_mutex_unlock(&thread_start_mutex);
+			g_cond_wait(&diskd_cond, &diskd_mutex);
+#else
+			g_cond_wait(diskd_cond, diskd_mutex);
+#endif
+			continue;
 		}
-	}
 
-	if (th_timer != NULL) {
-		g_cond_wait(&thread_start_cond, &thread_start_mutex);
-		g_mutex_unlock(&thread_start_mutex);
-	}
+		target = wd_heap[0];
+		now = g_get_monotonic_time();
+		if (now < target->wd_deadline) {
+#if GLIB_CHECK_VERSION(2, 32, 0)
+			g_cond_wait_until(&diskd_cond, &diskd_mutex, target->wd_deadline);
 #else
-	g_mutex_lock(thread_start_mutex);
+			GTimeVal gtime;
+
+			g_get_current_time(&gtime);
+			g_time_val_add(&gtime, target->wd_deadline - now);
+			g_cond_timed_wait(diskd_cond, diskd_mutex, &gtime);
+#endif
+			continue;
+		}
 
-	if (th_timer == NULL) {
-		th_timer = g_thread_create((GThreadFunc)diskd_thread_timer_func, NULL, TRUE, &gerr);
-		if (th_timer == NULL) {
-			crm_err("Cannot create diskd timer_thread. %s", gerr->message);
-			g_error_free(gerr);
-			diskd_thread_use = FALSE;
-			g_mutex_unlock(thread_start_mutex);
+		wd_heap_remove(target);
+		if (target->wd_counted == FALSE) {
+			target->n_timeouts++;
+			target->wd_counted = TRUE;
 		}
+		target->wd_expired = TRUE;
+		diskd_unlock();
+
+		/* the status is set and sent by the main loop, which a check never blocks */
+		g_idle_add(diskd_watchdog_expired, NULL);
+
+		diskd_lock();
 	}
+	diskd_unlock();
+	return NULL;
+}
+
+static const char *diskd_errno_name(int err)
+{
+	static char other[16];
 
-	if (th_timer != NULL) {
-		g_cond_wait(thread_start_cond, thread_start_mutex);
-		g_mutex_unlock(thread_start_mutex);
+	switch (err) {
+		case EIO:	return "EIO";
+		case ETIMEDOUT:	return "ETIMEDOUT";
+		case EILSEQ:	return "EILSEQ";
+		case ENOENT:	return "ENOENT";
+		case ENXIO:	return "ENXIO";
+		case ENODEV:	return "ENODEV";
+		case EACCES:	return "EACCES";
+		case EROFS:	return "EROFS";
+		case ENOSPC:	return "ENOSPC";
+		case EAGAIN:	return "EAGAIN";
+		case EBUSY:	return "EBUSY";
+		case EINVAL:	return "EINVAL";
+		case ENOMEM:	return "ENOMEM";
+		case ESTALE:	return "ESTALE";
+		case ENOMEDIUM:	return "ENOMEDIUM";
+		case EREMOTEIO:	return "EREMOTEIO";
 	}
-#endif
+	snprintf(other, sizeof(other), "%d", err);
+	return other;
 }
 
-static int diskcheck_wt(gpointer data)
+/*
+ * Flight recorder: one record per failed attempt and per finished check,
+ * with the latencies of the phases of the attempt.
+ */
+static void diskd_target_record(diskd_target_t *target, int result, int err)
 {
-	int fd = -1;
-	int err, i;
-	int select_err;
-	struct timeval timeout_tv;
-	fd_set write_fd_set;
+	diskd_record_t rec;
+	int phase;
 
-	crm_trace("diskcheck_wt start");
+	if (recorder_file == NULL || oneshot_flag) {
+		return;
+	}
+	rec.time = g_get_real_time();
+	rec.attr_name = target->attr_name;
+	rec.target = target_name(target);
+	diskd_lock();
+	rec.offset = (target->lat_last[DISKD_LAT_IO] < 0)? -1
+		: (target->wflag)? (gint64)target->woff : (gint64)target->roff;
+	rec.open = target->lat_last[DISKD_LAT_OPEN];
+	rec.io = target->lat_last[DISKD_LAT_IO];
+	rec.verify = target->lat_last[DISKD_LAT_VERIFY];
+	rec.total = target->lat_last[DISKD_LAT_TOTAL];
+	for (phase = 0; phase < DISKD_LAT_PHASES; phase++) {
+		target->lat_last[phase] = -1;
+	}
+	diskd_unlock();
+	rec.attempt = (gint16)target->attempt;
+	rec.result = (gint16)result;
+	rec.err = err;
+	diskd_recorder_add(&rec);
+}
 
-	diskd_thread_create();
+static int diskd_recorder_flush(gpointer data)
+{
+	diskd_recorder_dump(recorder_file, recorder_reason);
+	return TRUE;
+}
 
-	for (i = 0; i <= retry; i++) {
-		if ( i != 0 ) {
-			sleep(retry_interval);
-		}
+static void diskd_recorder_signal(int nsig)
+{
+	diskd_recorder_dump(recorder_file, "SIGUSR1");
+}
 
-		/* file open */
-		fd = open(wfile, O_WRONLY | O_CREAT | O_DSYNC | O_NONBLOCK, 0);
-		if (fd == -1) {
-			crm_err("Could not open %s", wfile);
-			crm_perror(LOG_ERR, "%s", wfile);
-			continue;  /* failed to open file. try re-open */
-		}
+/* Count a failed attempt with its errno */
+static void diskd_target_count_error(diskd_target_t *target, int err)
+{
+	int i;
 
-		while( 1 ) {
-			err = write(fd, buf, WRITE_DATA);  /* data write */
-			if (err == WRITE_DATA) {
-				crm_trace("data writing is OK");
-				close(fd);
-				if (-1 == remove((const char *)wfile)) {
-					crm_warn("failed to remove file %s", wfile);
-				}
-				diskd_thread_condsend();
-				check_status(normal);
-				return normal;  /* OK */
-			} else if (err != WRITE_DATA && errno == EAGAIN) {
-				crm_warn("write function return errno:EAGAIN");
-				FD_ZERO(&write_fd_set);
-				FD_SET(fd, &write_fd_set);
-				timeout_tv.tv_sec = timeout;
-				timeout_tv.tv_usec = 0;
-				select_err = select(fd+1, NULL, &write_fd_set, NULL, &timeout_tv);
-				if (select_err == 1) {
-					crm_warn("select ok, write again");
-					continue;  /* retly write */
-				} else if (select_err == -1) {
-					crm_err("select failed on file %s", wfile);
-					close(fd);
-					if (-1 == remove((const char *)wfile)) {
-						crm_warn("failed to remove file %s", wfile);
-					}
-					break;  /* failed to select */
-				} else {
-					crm_err("select time out on file %s", wfile);
-					close(fd);
-					if (-1 == remove((const char *)wfile)) {
-						crm_warn("failed to remove file %s", wfile);
-					}
-					break;  /* failed to select */
-				}
-			} else {
-				crm_err("Could not write to file %s", wfile);
-				crm_perror(LOG_ERR, "%s", wfile);
-				close(fd);
-				if (-1 == remove((const char *)wfile)) {
-					crm_warn("failed to remove file %s", wfile);
-				}
-				break;  /* failed to write */
-			}
+	diskd_target_record(target, DISKD_REC_FAILED, err);
+	/* one timeout per attempt, whether the watchdog or the engine saw it first */
+	diskd_lock();
+	if (err == ETIMEDOUT && target->wd_counted == FALSE) {
+		target->n_timeouts++;
+	}
+	target->wd_counted = FALSE;
+	diskd_unlock();
+	for (i = 0; i < ERRNO_SLOTS - 1; i++) {
+		if (target->n_errnos[i].err == err || target->n_errnos[i].count == 0) {
+			break;
 		}
 	}
-	/* after for loop */
-
-	diskd_thread_condsend();
+	/* the last slot takes all the others */
+	target->n_errnos[i].err = (i == ERRNO_SLOTS - 1)? -1 : err;
+	target->n_errnos[i].count++;
+}
 
-	crm_warn("Error(s) occurred in diskcheck_wt function.");
-	check_status(ERROR);
+/* Record the latency of a phase which began at start. Returns the current time. */
+static gint64 diskd_target_lat(diskd_target_t *target, int phase, gint64 start)
+{
+	gint64 now = g_get_monotonic_time();
 
-	return ERROR;
+	/* also from the checker thread, read by the reports */
+	diskd_lock();
+	diskd_lat_record(&target->lat[phase], now - start);
+	target->lat_last[phase] = (gint32)MIN(now - start, G_MAXINT32);
+	diskd_unlock();
+	return now;
 }
 
-static int diskcheck(gpointer data)
+/*
+ * Grade a successful check by the moving average (EWMA) of its total
+ * latency. The target becomes degraded above slow_threshold and normal
+ * again only below slow_clear, so it does not flap on a single threshold.
+ */
+static int diskd_target_grade(diskd_target_t *target, gint64 usec)
 {
-	int i;
-	int fd = -1;
-	int err;
-	int select_err;
-	struct timeval timeout_tv;
-	fd_set read_fd_set;
+	target->last_usec = usec;
+	target->spike = (target->ewma >= 0 && usec > ADAPT_SPIKE_MIN
+			 && usec > ADAPT_SPIKE_FACTOR * target->ewma);
 
-	crm_trace("diskcheck start");
+	if (target->ewma < 0) {
+		target->ewma = usec;
+	} else {
+		target->ewma = SLOW_EWMA_ALPHA * usec + (1 - SLOW_EWMA_ALPHA) * target->ewma;
+	}
 
-	diskd_thread_create();
+	if (target->slow_threshold <= 0) {
+		return normal;
+	}
 
-	for (i = 0; i <= retry; i++) {
-		if ( i != 0 ) {
-			sleep(retry_interval);
-		}
+	if (target->slow == FALSE && target->ewma > target->slow_threshold * 1000.0) {
+		target->slow = TRUE;
+		crm_warn("disk status is changed, attr_name=%s, target=%s, new_status=degraded"
+			" (average latency %.1fms > %dms)", target->attr_name, target_name(target),
+			target->ewma / 1000, target->slow_threshold);
+	} else if (target->slow && target->ewma < target->slow_clear * 1000.0) {
+		target->slow = FALSE;
+		crm_info("disk latency is back to normal, attr_name=%s, target=%s"
+			" (average latency %.1fms < %dms)", target->attr_name, target_name(target),
+			target->ewma / 1000, target->slow_clear);
+	}
+	return (target->slow)? degraded : normal;
+}
 
-		fd = open((const char *)device, O_RDONLY | O_NONBLOCK | O_DIRECT, 0);
-		if (fd == -1) {
-			crm_err("Could not open device %s", device);
-			continue;
-		}
+/*
+ * Phase of the checks of each target within the interval (-O). With
+ * <n>/<N> the targets of the node share its slot evenly.
+ */
+static void diskd_target_phases(void)
+{
+	struct utsname name;
+	GList *gIter;
+	int i = 0, n = g_list_length(targets);
 
-		while( 1 ) {
-			err = read(fd, buf, pagesize);
-			if (err == pagesize) {
-				crm_trace("reading form data is OK");
-				close(fd);
-				diskd_thread_condsend();
-				check_status(normal);
-				return normal;
-			} else if (err != pagesize && errno == EAGAIN) {
-				crm_warn("read function return errno:EAGAIN");
-				FD_ZERO(&read_fd_set);
-				FD_SET(fd, &read_fd_set);
-				timeout_tv.tv_sec = timeout;
-				timeout_tv.tv_usec = 0;
-				select_err = select(fd+1, &read_fd_set, NULL, NULL, &timeout_tv);
-				if (select_err == 1) {
-					crm_warn("select ok, read again");
-					continue;
-				} else if (select_err == -1) {
-					crm_err("select failed on device %s", device);
-					close(fd);
-					break;
-				}
-			} else {
-				crm_err("Could not read from device %s", device);
-				close(fd);
-				break;
+	if (uname(&name) < 0) {
+		strcpy(name.nodename, "");
+	}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next, i++) {
+		diskd_target_t *target = gIter->data;
+		guint64 h = 14695981039346656037ULL;	/* FNV-1a */
+		const char *p;
+
+		if (phase_count < 0) {
+			target->phase = -1;
+		} else if (phase_count > 0) {
+			target->phase = ((phase_slot % phase_count) + (double)i / n) / phase_count;
+		} else {
+			for (p = name.nodename; *p != '\0'; p++) {
+				h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+			}
+			for (p = target->attr_name; *p != '\0'; p++) {
+				h = (h ^ (unsigned char)*p) * 1099511628211ULL;
 			}
+			target->phase = (double)(h >> 11) / (double)(1ULL << 53);
 		}
+		crm_debug("phase of %s: %.3f", target_name(target), target->phase);
 	}
-	diskd_thread_condsend();
-
-	crm_warn("Error(s) occurred in diskcheck function.");
-	check_status(ERROR);
-
-	return ERROR;
 }
 
-static int oneshot(void)
+/*
+ * Arm the timer of the next check. The due times follow each other by
+ * exactly cur_interval on the monotonic clock, so the checks do not
+ * drift; a check that overran skips the slots it missed. When the
+ * interval changes the due time is anchored again to the phase, which
+ * is taken on the wall clock so that it is the same on every node.
+ */
+static gboolean diskd_target_tick(gpointer data);
+static gboolean diskd_target_mount_update(diskd_target_t *target);
+static void diskd_target_finish(diskd_target_t *target, int status, gboolean retried);
+static void diskd_target_passive_rebase(diskd_target_t *target);
+
+static void diskd_target_schedule(diskd_target_t *target)
 {
-	int rc = 0;
+	gint64 now = g_get_monotonic_time();
+	gint64 len = (gint64)target->cur_interval * 1000;
+	gint64 delay;
 
-	if ( wflag ) {	/* writer */
-		if (wfile == NULL) {
-			wdir = strdup(WRITE_DIR);
-			wfile = calloc(1, PATH_MAX);
-			g_snprintf(wfile, PATH_MAX, "%s/%s", WRITE_DIR, WRITE_FILE);
-		}
-		buf = (void *)malloc(WRITE_DATA);
-		if (buf == NULL) {
-			crm_err("Could not allocate memory");
-			crm_exit(1);
+	if (target->sched_interval != target->cur_interval) {
+		target->sched_interval = target->cur_interval;
+		if (target->phase < 0) {
+			target->next_due = now + len;
+		} else {
+			gint64 off = (gint64)(target->phase * len);
+
+			target->next_due = now + ((off - g_get_real_time() % len) % len + len) % len;
+			if (target->next_due <= now) {
+				/* the slot is now: it is the check that just ran */
+				target->next_due += len;
+			}
 		}
-		rc = diskcheck_wt(NULL);
-		free(wfile);
-	} else {	/* reader */
-		pagesize = getpagesize();
-		ptr = (void *)malloc(2 * pagesize);
-		if (ptr == NULL) {
-			crm_err("Could not allocate memory");
-			crm_exit(1);
+	} else {
+		target->next_due += len;
+		if (target->next_due <= now) {
+			target->next_due += ((now - target->next_due) / len + 1) * len;
 		}
-		buf = (void *)(((u_long)ptr + pagesize) & ~(pagesize-1));
-		rc = diskcheck(NULL);
-		free(ptr);
 	}
 
-	if (rc == ERROR) {
-		return ERROR;
+	delay = target->next_due - now;
+	if (jitter > 0) {
+		delay += g_random_int_range(0, MIN(jitter, target->cur_interval / 4) * 1000 + 1);
 	}
-	return 0;
+	target->timer_id = g_timeout_add((guint)(delay / 1000), diskd_target_tick, target);
 }
 
-int
-main(int argc, char **argv)
+/* A periodic check; no I/O to a file system known to be unusable */
+static void diskd_target_run(diskd_target_t *target)
 {
-	int argerr = 0;
-	int flag;
-	char *pid_file = NULL;
-	gboolean daemonize = FALSE;
+	if (target->wflag && diskd_target_mount_update(target)) {
+		if (target->in_flight == FALSE) {
+			diskd_target_finish(target, ERROR, FALSE);
+		}
+		return;
+	}
+	target->check_fn(target);
+}
 
-#ifdef HAVE_GETOPT_H
-	int option_index = 0;
+static gboolean diskd_target_tick(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	target->timer_id = 0;
+	diskd_target_run(target);
+	if (target->timer_id == 0) {
+		diskd_target_schedule(target);
+	}
+	return FALSE;
+}
+
+/*
+ * Adaptive scheduling (-A/-X). A suspect check (error, retry, latency
+ * spike or degraded) drops the interval to min_interval at once; after
+ * ADAPT_HEALTHY_CHECKS healthy checks in a row the interval is doubled,
+ * up to max_interval.
+ */
+static void diskd_target_adapt(diskd_target_t *target, gboolean suspect)
+{
+	int next = target->cur_interval;
+
+	if (target->min_interval >= target->max_interval * 1000) {
+		return;
+	}
+
+	if (suspect) {
+		target->healthy_checks = 0;
+		next = target->min_interval;
+	} else if (++target->healthy_checks >= ADAPT_HEALTHY_CHECKS) {
+		target->healthy_checks = 0;
+		next = MIN(next * 2, target->max_interval * 1000);
+	}
+	if (next == target->cur_interval) {
+		return;
+	}
+
+	crm_info("check interval of %s: %dms -> %dms", target_name(target),
+		target->cur_interval, next);
+	target->cur_interval = next;
+	if (target->timer_id != 0) {
+		/* otherwise diskd_target_tick() schedules the next check */
+		g_source_remove(target->timer_id);
+		target->timer_id = 0;
+		diskd_target_schedule(target);
+	}
+}
+
+/* A check of target has ended with status */
+static void diskd_target_finish(diskd_target_t *target, int status, gboolean retried)
+{
+	diskd_lat_summary_t sum;
+
+	diskd_target_passive_rebase(target);
+	target->check_end = g_get_monotonic_time();
+	diskd_lock();
+	target->wd_counted = FALSE;
+	diskd_unlock();
+
+	if (status_file != NULL) {
+		diskd_lock();
+		diskd_lat_summary(&target->lat[DISKD_LAT_TOTAL], TRUE, &sum);
+		target->shm.last_check = g_get_real_time();
+		target->shm.checks++;
+		if (status == ERROR) {
+			target->shm.errors++;
+			target->shm.last_latency = g_get_monotonic_time() - target->check_start;
+		} else {
+			target->shm.last_ok = target->shm.last_check;
+			target->shm.last_latency = target->last_usec;
+		}
+		target->shm.p50 = sum.p50;
+		target->shm.p99 = sum.p99;
+		target->shm.max = sum.max;
+		diskd_unlock();
+	}
+	if (target->mount_error != NULL) {
+		status = ERROR;
+	} else if (status == normal && target->tp_slow) {
+		status = degraded;
+	}
+	target->n_checks++;
+	if (status == ERROR) {
+		target->n_failures++;
+	}
+	diskd_target_record(target, (status == ERROR)? DISKD_REC_ERROR
+		: (status == degraded)? DISKD_REC_DEGRADED : DISKD_REC_NORMAL, 0);
+	check_status(target, status);
+	diskd_target_adapt(target, status != normal || retried || target->spike);
+}
+
+/*
+ * Allocate and write the whole probe file once, so later checks only
+ * overwrite blocks in place and cause no metadata update.
+ */
+static gboolean diskd_target_prealloc(diskd_target_t *target, int fd)
+{
+	off_t size = (off_t)WRITE_SLOTS * pagesize;
+	struct stat st;
+	off_t offset;
+	int rc;
+
+	if (fstat(fd, &st) == 0 && st.st_size == size) {
+		return TRUE;
+	}
+
+	rc = posix_fallocate(fd, 0, size);
+	if (rc != 0 && rc != EOPNOTSUPP) {
+		crm_err("Could not allocate %s: %s", target->wfile, strerror(rc));
+		return FALSE;
+	}
+	memset(target->iobuf, 0, pagesize);
+	for (offset = 0; offset < size; offset += pagesize) {
+		if (pwrite(fd, target->iobuf, pagesize, offset) != pagesize) {
+			crm_err("Could not initialize %s", target->wfile);
+			crm_perror(LOG_ERR, "%s", target->wfile);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/* Capacity of the device, for the random offset of the read check */
+static void diskd_target_getsize(diskd_target_t *target, int fd)
+{
+	guint64 size = 0;
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size = st.st_size;
+	} else if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+		crm_perror(LOG_WARNING, "BLKGETSIZE64 on %s", target->device);
+		size = 0;
+	}
+	if (size != target->dev_size) {
+		crm_debug("size of %s: %llu bytes", target->device, (unsigned long long)size);
+		target->dev_size = size;
+	}
+}
+
+/*
+ * Offset of the next read check. With -R it is a pseudo-random, page
+ * aligned offset anywhere on the device, so the array cannot answer from
+ * a cached sector 0.
+ */
+static off_t diskd_random_offset(diskd_target_t *target, guint64 *state)
+{
+	guint64 nblocks;
+	guint64 x;
+
+	if (random_offset_flag == 0) {
+		return 0;
+	}
+	nblocks = target->dev_size / pagesize;
+	if (nblocks <= (guint64)(probe_size / pagesize)) {
+		return 0;
+	}
+	nblocks -= probe_size / pagesize - 1;
+
+	/* xorshift64* */
+	x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (off_t)(((x * 0x2545F4914F6CDD1DULL) >> 11) % nblocks) * pagesize;
+}
+
+static off_t diskd_target_roffset(diskd_target_t *target)
+{
+	target->roff = diskd_random_offset(target, &target->rnd_state);
+	return target->roff;
+}
+
+/*
+ * Read len bytes at offset. With -F the read is a SCSI READ(16) with the
+ * FUA bit set, so the array must go to the media instead of its cache.
+ * SG_IO blocks for at most the SCSI command timeout (= check timeout).
+ * A device which does not take SG_IO falls back to a normal read.
+ */
+static ssize_t diskd_target_read(diskd_target_t *target, int fd, off_t offset, size_t len)
+{
+#ifdef HAVE_SCSI_SG_H
+	sg_io_hdr_t io_hdr;
+	unsigned char cdb[16];
+	unsigned char sense[32];
+	guint64 lba;
+	guint32 nlb;
+	int lbs = 512;
+	int i;
+
+	if (bypass_cache_flag == 0 || target->sg_unsupported) {
+		return pread(fd, target->iobuf, len, offset);
+	}
+	if (ioctl(fd, BLKSSZGET, &lbs) < 0 || lbs <= 0) {
+		lbs = 512;
+	}
+	lba = offset / lbs;
+	nlb = len / lbs;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = 0x88;			/* READ(16) */
+	cdb[1] = 0x08;			/* FUA */
+	for (i = 0; i < 8; i++) {
+		cdb[2 + i] = (lba >> (56 - 8 * i)) & 0xff;
+	}
+	for (i = 0; i < 4; i++) {
+		cdb[10 + i] = (nlb >> (24 - 8 * i)) & 0xff;
+	}
+
+	memset(&io_hdr, 0, sizeof(io_hdr));
+	io_hdr.interface_id = 'S';
+	io_hdr.cmd_len = sizeof(cdb);
+	io_hdr.cmdp = cdb;
+	io_hdr.mx_sb_len = sizeof(sense);
+	io_hdr.sbp = sense;
+	io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+	io_hdr.dxfer_len = len;
+	io_hdr.dxferp = target->iobuf;
+	io_hdr.timeout = target->timeout * 1000;
+
+	if (ioctl(fd, SG_IO, &io_hdr) < 0) {
+		if (errno == ENOTTY || errno == EINVAL) {
+			crm_info("%s does not support SG_IO, the cache is not bypassed", target->device);
+			target->sg_unsupported = TRUE;
+			return pread(fd, target->iobuf, len, offset);
+		}
+		return -1;
+	}
+	if ((io_hdr.info & SG_INFO_OK_MASK) != SG_INFO_OK) {
+		crm_err("SCSI READ(16) on %s failed: status=0x%x host=0x%x driver=0x%x",
+			target->device, io_hdr.status, io_hdr.host_status, io_hdr.driver_status);
+		errno = (io_hdr.duration >= io_hdr.timeout)? ETIMEDOUT : EIO;
+		return -1;
+	}
+	return len - io_hdr.resid;
+#else
+	return pread(fd, target->iobuf, len, offset);
+#endif
+}
+
+/*
+ * A write target is opened with O_DIRECT for -W and for the aio engine:
+ * Linux AIO runs a buffered write inside io_submit(), a hung disk would
+ * block the main loop. Where O_DIRECT is not supported (direct_off),
+ * the write goes through the page cache, and to an I/O worker with aio.
+ */
+static gboolean diskd_target_wdirect(diskd_target_t *target)
+{
+	return (verify_flag || diskd_io_engine() == DISKD_IO_AIO) && target->direct_off == FALSE;
+}
+
+/*
+ * Verified write check (-W). Each write is a whole page stamped with a
+ * sequence number, the time and a checksum, written with O_DIRECT and
+ * read back with O_DIRECT into the second page of target->vblock.
+ */
+static int diskd_write_len(diskd_target_t *target)
+{
+	return (verify_flag || diskd_target_wdirect(target))? pagesize : WRITE_DATA;
+}
+
+/* FNV-1a of the block, the checksum field counted as 0 */
+static guint64 diskd_block_checksum(const unsigned char *blk)
+{
+	size_t skip = offsetof(diskd_block_hdr_t, checksum);
+	guint64 h = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < pagesize; i++) {
+		unsigned char c = (i >= skip && i < skip + sizeof(guint64))? 0 : blk[i];
+
+		h = (h ^ c) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* The data of the next write */
+static void *diskd_target_wbuf(diskd_target_t *target)
+{
+	diskd_block_hdr_t *hdr;
+	guint64 *word;
+	guint64 x;
+	int i;
+
+	if (verify_flag == 0) {
+		return target->iobuf;
+	}
+
+	hdr = target->vblock;
+	memcpy(hdr->magic, DISKD_BLOCK_MAGIC, sizeof(hdr->magic));
+	hdr->seq = ++target->wseq;
+	hdr->stamp = g_get_real_time();
+	hdr->checksum = 0;
+
+	/* the rest is a pattern of the sequence number, a stale block never matches */
+	x = hdr->seq * 0x9E3779B97F4A7C15ULL | 1;
+	word = (guint64 *)(hdr + 1);
+	for (i = 0; i < (pagesize - (int)sizeof(*hdr)) / (int)sizeof(guint64); i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		word[i] = x;
+	}
+	hdr->checksum = diskd_block_checksum(target->vblock);
+	return target->vblock;
+}
+
+/* Check the block read back (result bytes) against the one written */
+static gboolean diskd_block_verify(diskd_target_t *target, ssize_t result)
+{
+	const unsigned char *rd = (unsigned char *)target->vblock + pagesize;
+	const diskd_block_hdr_t *hdr = (const diskd_block_hdr_t *)rd;
+	const char *why = NULL;
+
+	if (result != pagesize) {
+		why = "short read";
+	} else if (memcmp(hdr->magic, DISKD_BLOCK_MAGIC, sizeof(hdr->magic)) != 0) {
+		why = "no diskd block";
+	} else if (hdr->checksum != diskd_block_checksum(rd)) {
+		why = "checksum mismatch";
+	} else if (hdr->seq != target->wseq) {
+		crm_err("verify failed on %s: sequence %llu, expected %llu (lost write)",
+			target->wfile, (unsigned long long)hdr->seq,
+			(unsigned long long)target->wseq);
+		return FALSE;
+	} else if (memcmp(rd, target->vblock, pagesize) != 0) {
+		why = "data mismatch";
+	}
+
+	if (why != NULL) {
+		crm_err("verify failed on %s: %s", target->wfile, why);
+		return FALSE;
+	}
+	crm_trace("verify of %s is OK (seq %llu)", target->wfile, (unsigned long long)hdr->seq);
+	return TRUE;
+}
+
+/* Blocking read back of a verified write. t: end of the write */
+static gboolean diskd_target_verify(diskd_target_t *target, int fd, off_t offset, gint64 t)
+{
+	ssize_t rc;
+
+	rc = pread(fd, (unsigned char *)target->vblock + pagesize, pagesize, offset);
+	diskd_target_lat(target, DISKD_LAT_VERIFY, t);
+	if (rc < 0) {
+		crm_err("Could not read back %s", target->wfile);
+		crm_perror(LOG_ERR, "%s", target->wfile);
+		return FALSE;
+	}
+	return diskd_block_verify(target, rc);
+}
+
+/*
+ * Open the target for a check. With -k (keep-open) the descriptor is kept
+ * across checks and only reopened after an error or when the device node
+ * or the probe file has been replaced.
+ */
+static int diskd_target_open(diskd_target_t *target)
+{
+	const char *path = (target->wflag)? target->wfile : target->device;
+	struct stat st;
+	int fd;
+
+	if (target->fd >= 0) {
+		if (stat(path, &st) == 0
+		    && ((target->wflag)? (st.st_dev == target->st_dev && st.st_ino == target->st_ino)
+				       : (st.st_rdev == target->st_rdev))) {
+			return target->fd;
+		}
+		crm_info("%s has been changed. reopen it.", path);
+		close(target->fd);
+		target->fd = -1;
+	}
+
+	if (target->wflag && (verify_flag || diskd_io_engine() == DISKD_IO_AIO)) {
+		int mode = (verify_flag)? O_RDWR : O_WRONLY;
+
+		fd = -1;
+		if (target->direct_off == FALSE) {
+			fd = open(path, mode | O_CREAT | O_DSYNC | O_NONBLOCK | O_DIRECT, 0);
+		}
+		if (fd == -1 && (target->direct_off || errno == EINVAL)) {
+			if (target->direct_off == FALSE) {
+				crm_warn("%s does not support O_DIRECT, the write %s", target->wdir,
+					(diskd_io_engine() == DISKD_IO_AIO)? "check runs in an I/O worker"
+					: "is verified through the page cache");
+				target->direct_off = TRUE;
+			}
+			fd = open(path, mode | O_CREAT | O_DSYNC | O_NONBLOCK, 0);
+		}
+	} else if (target->wflag) {
+		fd = open(path, O_WRONLY | O_CREAT | O_DSYNC | O_NONBLOCK, 0);
+	} else {
+		fd = open(path, O_RDONLY | O_NONBLOCK | O_DIRECT, 0);
+	}
+	if (fd != -1 && target->wflag == FALSE && random_offset_flag) {
+		diskd_target_getsize(target, fd);
+	}
+	if (fd == -1 || keep_open_flag == 0) {
+		return fd;
+	}
+
+	if (target->wflag && diskd_target_prealloc(target, fd) == FALSE) {
+		close(fd);
+		return -1;
+	}
+	if (fstat(fd, &st) == 0) {
+		target->st_dev = st.st_dev;
+		target->st_ino = st.st_ino;
+		target->st_rdev = st.st_rdev;
+	}
+	target->fd = fd;
+	return fd;
+}
+
+/* Release the descriptor after a check. failed: the check did not succeed */
+static void diskd_target_close(diskd_target_t *target, int fd, gboolean failed)
+{
+	if (keep_open_flag && failed == FALSE) {
+		return;
+	}
+
+	close(fd);
+	if (fd == target->fd) {
+		target->fd = -1;
+	}
+	if (target->wflag && keep_open_flag == 0
+	    && -1 == remove((const char *)target->wfile)) {
+		crm_warn("failed to remove file %s", target->wfile);
+	}
+}
+
+/* Offset of the next write check, rotating over the preallocated file */
+static off_t diskd_target_woffset(diskd_target_t *target)
+{
+	off_t offset;
+
+	if (keep_open_flag == 0) {
+		return 0;
+	}
+	offset = (off_t)target->wslot * pagesize;
+	target->wslot = (target->wslot + 1) % WRITE_SLOTS;
+	return offset;
+}
+
+/*
+ * Multipath paths (-M). Each slave path of a dm device is probed at the
+ * same time as the device itself, so a lost path is seen at once, and
+ * "<attr_name>-paths" is set to "<healthy>/<total>".
+ */
+static void
+diskd_paths_publish(diskd_target_t *target)
+{
+	GList *gIter;
+	char value[sizeof(target->paths_value)];
+	int healthy = 0;
+	int total = 0;
+
+	for (gIter = target->paths; gIter != NULL; gIter = gIter->next) {
+		diskd_path_t *path = gIter->data;
+
+		total++;
+		if (path->healthy) {
+			healthy++;
+		}
+	}
+	g_snprintf(value, sizeof(value), "%d/%d", healthy, total);
+
+	diskd_lock();
+	if (strcmp(target->paths_value, value) != 0) {
+		crm_notice("paths of %s: %s healthy", target->device, value);
+		strcpy(target->paths_value, value);
+		target->paths_dirty = TRUE;
+		if (attrd_trigger != NULL) {
+			mainloop_set_trigger(attrd_trigger);
+		}
+	}
+	diskd_unlock();
+}
+
+static void
+diskd_path_done(diskd_path_t *path, ssize_t result, int err)
+{
+	gboolean healthy = (result == probe_size);
+
+	path->last = g_get_monotonic_time() - path->start;
+	diskd_lat_record(&path->lat, path->last);
+	if (path->fd >= 0) {
+		close(path->fd);
+		path->fd = -1;
+	}
+	path->in_flight = FALSE;
+	diskd_target_passive_rebase(path->target);
+
+	if (healthy != path->healthy) {
+		if (healthy) {
+			crm_notice("path %s of %s is healthy", path->name, path->target->device);
+		} else {
+			crm_warn("path %s of %s failed: %s", path->name, path->target->device,
+				(result < 0)? strerror(err) : "short transfer");
+		}
+		path->healthy = healthy;
+	}
+	diskd_paths_publish(path->target);
+}
+
+static void
+diskd_path_io_done(gpointer data, ssize_t result, int err)
+{
+	diskd_path_done(data, result, err);
+}
+
+static gboolean
+diskd_path_thread_done(gpointer data)
+{
+	diskd_path_t *path = data;
+
+	diskd_path_done(path, path->result, path->err);
+	return FALSE;
+}
+
+/* Probe of a path without an asynchronous I/O engine. Ends on the main loop. */
+static gpointer
+diskd_path_thread(gpointer data)
+{
+	diskd_path_t *path = data;
+
+	path->fd = open(path->devnode, O_RDONLY | O_DIRECT, 0);
+	if (path->fd < 0) {
+		path->result = -1;
+		path->err = errno;
+	} else {
+		path->result = pread(path->fd, path->buf, probe_size, path->offset);
+		path->err = errno;
+	}
+	g_idle_add(diskd_path_thread_done, path);
+	return NULL;
+}
+
+static void
+diskd_path_probe(diskd_path_t *path, off_t offset)
+{
+	int rc;
+
+	path->in_flight = TRUE;
+	path->start = g_get_monotonic_time();
+	path->offset = offset;
+
+	if (diskd_io_engine() != DISKD_IO_SYNC) {
+		path->fd = open(path->devnode, O_RDONLY | O_NONBLOCK | O_DIRECT, 0);
+		if (path->fd < 0) {
+			diskd_path_done(path, -1, errno);
+			return;
+		}
+		rc = diskd_io_submit(path->fd, FALSE, path->buf, probe_size, offset,
+			path->target->timeout, diskd_path_io_done, path);
+		if (rc < 0) {
+			diskd_path_done(path, -1, -rc);
+		}
+		return;
+	}
+
+	if (diskd_thread_start(path->name, diskd_path_thread, path) == FALSE) {
+		diskd_path_done(path, -1, EAGAIN);
+	}
+}
+
+static void
+diskd_path_free(gpointer data)
+{
+	diskd_path_t *path = data;
+
+	if (path->in_flight) {
+		/* the probe still refers to it */
+		return;
+	}
+	free(path->name);
+	free(path->devnode);
+	free(path->buf);
+	free(path);
+}
+
+/* Update the path list from sysfs. Paths may come and go at any time. */
+static void
+diskd_paths_discover(diskd_target_t *target)
+{
+	GList *names = diskd_mpath_slaves(target->device);
+	GList *gIter, *gIter2, *next;
+
+	for (gIter = target->paths; gIter != NULL; gIter = gIter->next) {
+		((diskd_path_t *)gIter->data)->seen = FALSE;
+	}
+
+	for (gIter = names; gIter != NULL; gIter = gIter->next) {
+		const char *name = gIter->data;
+		diskd_path_t *path = NULL;
+
+		for (gIter2 = target->paths; gIter2 != NULL; gIter2 = gIter2->next) {
+			if (strcmp(((diskd_path_t *)gIter2->data)->name, name) == 0) {
+				path = gIter2->data;
+				break;
+			}
+		}
+		if (path == NULL) {
+			path = calloc(1, sizeof(diskd_path_t));
+			if (path == NULL || posix_memalign(&path->buf, pagesize, probe_size) != 0) {
+				crm_err("Could not allocate memory");
+				free(path);
+				continue;
+			}
+			path->target = target;
+			path->name = strdup(name);
+			path->devnode = diskd_mpath_devnode(name);
+			path->fd = -1;
+			path->healthy = TRUE;
+			target->paths = g_list_append(target->paths, path);
+			crm_info("path %s (%s) of %s is found", path->name, path->devnode, target->device);
+		}
+		path->seen = TRUE;
+	}
+	g_list_free_full(names, free);
+
+	for (gIter = target->paths; gIter != NULL; gIter = next) {
+		diskd_path_t *path = gIter->data;
+
+		next = gIter->next;
+		if (path->seen == FALSE && path->in_flight == FALSE) {
+			crm_info("path %s of %s is removed", path->name, target->device);
+			target->paths = g_list_delete_link(target->paths, gIter);
+			diskd_path_free(path);
+		}
+	}
+}
+
+/* Start the probe of every path of target, in parallel with its own check */
+static void
+diskd_paths_start(diskd_target_t *target)
+{
+	GList *gIter;
+	off_t offset;
+
+	if (multipath_flag == 0 || target->wflag || oneshot_flag) {
+		return;
+	}
+
+	diskd_paths_discover(target);
+	offset = diskd_random_offset(target, &target->paths_rnd_state);
+	for (gIter = target->paths; gIter != NULL; gIter = gIter->next) {
+		diskd_path_t *path = gIter->data;
+
+		if (path->in_flight) {
+			/* only a blocking probe thread can be left behind */
+			if (path->healthy) {
+				crm_warn("path %s of %s does not respond", path->name, target->device);
+				path->healthy = FALSE;
+			}
+			continue;
+		}
+		diskd_path_probe(path, offset);
+	}
+	diskd_paths_publish(target);
+}
+
+/*
+ * Passive monitoring (-P). The I/O statistics of the block device under
+ * the target (/sys/dev/block/<maj>:<min>/stat) are sampled at each check:
+ *   - requests completed since the last sample, or since the end of the
+ *     last probe of diskd itself: the disk is serving I/O, the average
+ *     service time is graded like a check latency and no probe is issued.
+ *   - requests in flight but none completed: the disk is suspect, and
+ *     hung once this lasts for the check timeout. No probe is issued,
+ *     it would only queue up behind them.
+ *   - idle: the normal probe is run.
+ * Returns TRUE when the check has been settled without a probe.
+ */
+static gboolean diskd_target_pstat(diskd_target_t *target, guint64 *ios, guint64 *ticks)
+{
+	unsigned long long f[11];
+	struct stat st;
+	FILE *fp;
+	int n;
+
+	if (target->stat_path == NULL) {
+		const char *path = (target->wflag)? target->wdir : target->device;
+
+		if (stat(path, &st) < 0) {
+			crm_perror(LOG_WARNING, "%s", path);
+			return FALSE;
+		}
+		target->stat_path = g_strdup_printf("/sys/dev/block/%u:%u/stat",
+			(target->wflag)? major(st.st_dev) : major(st.st_rdev),
+			(target->wflag)? minor(st.st_dev) : minor(st.st_rdev));
+	}
+
+	fp = fopen(target->stat_path, "r");
+	if (fp == NULL) {
+		crm_warn("No I/O statistics of %s (%s), passive monitoring is disabled for it",
+			target_name(target), target->stat_path);
+		target->passive_off = TRUE;
+		return FALSE;
+	}
+	/* reads merges sectors ticks writes merges sectors ticks in_flight io_ticks queue */
+	n = fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
+		&f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7], &f[8], &f[9], &f[10]);
+	fclose(fp);
+	if (n != 11) {
+		crm_warn("Unexpected format of %s, passive monitoring is disabled for %s",
+			target->stat_path, target_name(target));
+		target->passive_off = TRUE;
+		return FALSE;
+	}
+
+	*ios = f[0] + f[4];
+	*ticks = f[3] + f[7];
+	target->p_inflight = f[8];
+	return TRUE;
+}
+
+/*
+ * An active probe of diskd (check, path probe, throughput burst) has
+ * ended: its own requests must not count as I/O served by the disk, or
+ * the next check would be settled by them while the disk may be dead.
+ */
+static void diskd_target_passive_rebase(diskd_target_t *target)
+{
+	guint64 ios, ticks;
+
+	if (passive_flag == 0 || oneshot_flag || target->passive_off || target->p_valid == FALSE) {
+		return;
+	}
+	if (diskd_target_pstat(target, &ios, &ticks)) {
+		target->p_ios = ios;
+		target->p_ticks = ticks;
+	}
+}
+
+static gboolean diskd_target_passive(diskd_target_t *target)
+{
+	guint64 ios, ticks;
+	gint64 now = g_get_monotonic_time();
+
+	if (passive_flag == 0 || oneshot_flag || target->passive_off || target->kevent_check) {
+		return FALSE;
+	}
+	if (diskd_target_pstat(target, &ios, &ticks) == FALSE) {
+		return FALSE;
+	}
+	if (target->p_valid == FALSE) {
+		target->p_valid = TRUE;
+		target->p_ios = ios;
+		target->p_ticks = ticks;
+		return FALSE;
+	}
+
+	if (ios != target->p_ios) {
+		target->p_service = (double)(ticks - target->p_ticks) / (ios - target->p_ios);
+		target->p_ios = ios;
+		target->p_ticks = ticks;
+		target->hang_since = 0;
+		crm_trace("%s: passive, %.2fms per request", target_name(target), target->p_service);
+		diskd_target_finish(target, diskd_target_grade(target, target->p_service * 1000), FALSE);
+		return TRUE;
+	}
+
+	if (target->p_inflight == 0) {
+		target->hang_since = 0;
+		return FALSE;
+	}
+
+	if (target->hang_since == 0) {
+		target->hang_since = now;
+		crm_warn("%s: %u request(s) in flight without completion", target_name(target),
+			target->p_inflight);
+	}
+	if (now - target->hang_since >= target->timeout * G_TIME_SPAN_SECOND) {
+		crm_err("%s: no request completed for %ds with %u in flight. hung.",
+			target_name(target), target->timeout, target->p_inflight);
+		diskd_target_finish(target, ERROR, FALSE);
+	} else {
+		diskd_target_adapt(target, TRUE);
+	}
+	return TRUE;
+}
+
+/*
+ * Kernel events (-K). A kernel report about the device of a target, one
+ * of its paths or its whole disk triggers a check at once instead of at
+ * the next tick, and the check interval drops to -A while suspect.
+ * Reports within KEVENT_GRACE after a check of the target are taken for
+ * the echo of its own I/O, and a target already in ERROR is left alone.
+ */
+static gboolean diskd_target_devno(diskd_target_t *target, dev_t *devno)
+{
+	struct stat st;
+
+	if (stat((target->wflag)? target->wdir : target->device, &st) < 0) {
+		return FALSE;
+	}
+	*devno = (target->wflag)? st.st_dev : st.st_rdev;
+	return TRUE;
+}
+
+static gboolean diskd_target_related(diskd_target_t *target, const char *name)
+{
+	gint64 now = g_get_monotonic_time();
+	dev_t devno;
+	GList *gIter;
+
+	/* the names are kept, a removed device must still match */
+	if (now - target->knames_time > KNAMES_TTL * G_TIME_SPAN_SECOND
+	    && diskd_target_devno(target, &devno)) {
+		g_list_free_full(target->knames, free);
+		target->knames = diskd_mpath_related(devno);
+		target->knames_time = now;
+	}
+
+	for (gIter = target->knames; gIter != NULL; gIter = gIter->next) {
+		if (strcmp(gIter->data, name) == 0) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void diskd_kevent(const char *name, const char *reason)
+{
+	gint64 now = g_get_monotonic_time();
+	GList *gIter;
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (diskd_target_related(target, name) == FALSE) {
+			continue;
+		}
+		if (target->value != NULL && strcmp(target->value, "ERROR") == 0) {
+			/* already known to be bad */
+			continue;
+		}
+		if (now - target->check_end < KEVENT_GRACE * G_TIME_SPAN_SECOND) {
+			/* most likely the I/O error of our own check */
+			crm_debug("kernel event for %s (%s) after its check: %s. ignored.",
+				target_name(target), name, reason);
+			continue;
+		}
+		diskd_target_adapt(target, TRUE);
+		if (target->in_flight || now - target->kevent_time < MIN_ADAPT_INTERVAL * 1000) {
+			/* a check is running or has just been triggered */
+			continue;
+		}
+		crm_notice("kernel event for %s (%s): %s. checking now.",
+			target_name(target), name, reason);
+		target->kevent_time = now;
+		target->kevent_check = TRUE;
+		diskd_target_run(target);
+		target->kevent_check = FALSE;
+	}
+}
+
+/*
+ * File system of a write target. A read-only remount (e.g. after a
+ * journal error) or another file system at wdir (lazy unmount,
+ * overmount) is an error at once, found from the mount table events and
+ * stat(), without any I/O to the disk.
+ */
+static const char *diskd_target_mount_state(diskd_target_t *target)
+{
+	struct statvfs vfs;
+	struct stat st;
+
+	if (stat(target->wdir, &st) < 0 || statvfs(target->wdir, &vfs) < 0) {
+		return "not accessible";
+	}
+	if (target->wdir_dev != 0 && st.st_dev != target->wdir_dev) {
+		return "replaced by another file system";
+	}
+	if (vfs.f_flag & ST_RDONLY) {
+		return "read-only";
+	}
+	return NULL;
+}
+
+/* Returns TRUE while the file system of target is unusable */
+static gboolean diskd_target_mount_update(diskd_target_t *target)
+{
+	const char *reason = diskd_target_mount_state(target);
+
+	if (reason != NULL && target->mount_error == NULL) {
+		crm_err("file system of %s is %s", target->wdir, reason);
+		if (target->fd >= 0 && target->in_flight == FALSE) {
+			/* kept open (-k) on what may be the old file system */
+			diskd_target_close(target, target->fd, TRUE);
+		}
+	} else if (reason == NULL && target->mount_error != NULL) {
+		crm_notice("file system of %s is usable again", target->wdir);
+	}
+	target->mount_error = reason;
+	return (reason != NULL);
+}
+
+static void diskd_mount_changed(void)
+{
+	GList *gIter;
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		gboolean was = (target->mount_error != NULL);
+
+		if (target->wflag && diskd_target_mount_update(target) && was == FALSE
+		    && target->in_flight == FALSE) {
+			/* a running check finishes with ERROR for mount_error */
+			diskd_target_finish(target, ERROR, FALSE);
+		}
+	}
+}
+
+/*
+ * Health logs (-C). The SMART / NVMe health log of the disks under each
+ * target is read at health_interval by a thread, and "<attr_name>-health"
+ * is set to "predicted-failure" when one of them predicts its failure,
+ * "ok" otherwise. The checks do not depend on it: a node is drained by a
+ * rule on this attribute before its disk fails.
+ */
+static void diskd_health_merge(diskd_health_t *worst, const char *name, const diskd_health_t *health)
+{
+	if (health->state == DISKD_HEALTH_UNKNOWN) {
+		return;
+	}
+	if (health->state > worst->state) {
+		worst->state = health->state;
+		worst->backend = health->backend;
+		if (health->state == DISKD_HEALTH_FAILING) {
+			g_snprintf(worst->reason, sizeof(worst->reason), "%s: %s", name, health->reason);
+		}
+	}
+	worst->temperature = MAX(worst->temperature, health->temperature);
+	worst->wear = MAX(worst->wear, health->wear);
+	if (health->defects >= 0) {
+		worst->defects = MAX(worst->defects, 0) + health->defects;
+	}
+}
+
+static void diskd_health_publish(diskd_target_t *target)
+{
+	const char *value;
+
+	if (target->health.state == DISKD_HEALTH_UNKNOWN) {
+		/* no backend can read the logs (now), the last value is kept */
+		return;
+	}
+	value = (target->health.state == DISKD_HEALTH_FAILING)? "predicted-failure" : "ok";
+
+	diskd_lock();
+	if (strcmp(target->health_value, value) != 0) {
+		if (target->health.state == DISKD_HEALTH_FAILING) {
+			crm_warn("a disk of %s predicts its failure (%s)", target_name(target),
+				target->health.reason);
+		} else {
+			crm_notice("health of the disks of %s: %s", target_name(target), value);
+		}
+		g_strlcpy(target->health_value, value, sizeof(target->health_value));
+		target->health_dirty = TRUE;
+		if (attrd_trigger != NULL) {
+			mainloop_set_trigger(attrd_trigger);
+		}
+	}
+	diskd_unlock();
+}
+
+static gboolean diskd_health_done(gpointer data)
+{
+	GList *jobs = data;
+	GList *gIter;
+
+	for (gIter = jobs; gIter != NULL; gIter = gIter->next) {
+		diskd_health_job_t *job = gIter->data;
+
+		job->target->health = job->health;
+		diskd_health_publish(job->target);
+		g_list_free_full(job->names, free);
+		free(job);
+	}
+	g_list_free(jobs);
+	health_running = FALSE;
+	return FALSE;
+}
+
+/* The commands may block for their timeout. Ends on the main loop. */
+static gpointer diskd_health_thread(gpointer data)
+{
+	GList *jobs = data;
+	GList *gIter, *gIter2;
+	diskd_health_t health;
+
+	for (gIter = jobs; gIter != NULL; gIter = gIter->next) {
+		diskd_health_job_t *job = gIter->data;
+
+		for (gIter2 = job->names; gIter2 != NULL; gIter2 = gIter2->next) {
+			/* a disk shared by targets is read once a round */
+			diskd_health_read(gIter2->data, health_interval / 2, &health);
+			diskd_health_merge(&job->health, gIter2->data, &health);
+		}
+	}
+	g_idle_add(diskd_health_done, jobs);
+	return NULL;
+}
+
+static gboolean diskd_health_tick(gpointer data)
+{
+	GList *jobs = NULL;
+	GList *gIter, *gIter2, *next;
+	dev_t devno;
+
+	if (health_running) {
+		crm_warn("the health logs of the last round are still being read");
+		return TRUE;
+	}
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+		diskd_health_job_t *job;
+
+		if (diskd_target_devno(target, &devno) == FALSE) {
+			continue;
+		}
+		job = calloc(1, sizeof(diskd_health_job_t));
+		if (job == NULL) {
+			crm_err("Could not allocate memory");
+			continue;
+		}
+		job->target = target;
+		job->health.temperature = -1;
+		job->health.wear = -1;
+		job->health.defects = -1;
+		job->names = diskd_mpath_related(devno);
+		for (gIter2 = job->names; gIter2 != NULL; gIter2 = next) {
+			next = gIter2->next;
+			if (diskd_health_is_disk(gIter2->data) == FALSE) {
+				free(gIter2->data);
+				job->names = g_list_delete_link(job->names, gIter2);
+			}
+		}
+		jobs = g_list_append(jobs, job);
+	}
+	if (jobs == NULL) {
+		return TRUE;
+	}
+
+	health_running = TRUE;
+	if (diskd_thread_start("health", diskd_health_thread, jobs) == FALSE) {
+		for (gIter = jobs; gIter != NULL; gIter = gIter->next) {
+			((diskd_health_job_t *)gIter->data)->health.state = DISKD_HEALTH_UNKNOWN;
+		}
+		diskd_health_done(jobs);
+	}
+	return TRUE;
+}
+
+/*
+ * Throughput probe (-b). A short sequential burst tells an array in
+ * rebuild or without write-back cache from a healthy one, which the
+ * single small check cannot. Device targets are read, write targets
+ * write their own file "<wfile>-throughput". The burst runs through the
+ * I/O engine with tp_depth requests in flight and ends after tp_size
+ * bytes or tp_duration seconds. The bytes of the bursts in the last hour
+ * never exceed tp_budget.
+ */
+static void diskd_tp_submit(diskd_tp_slot_t *slot);
+
+static void diskd_tp_end(diskd_target_t *target)
+{
+	gint64 elapsed = g_get_monotonic_time() - target->tp_start;
+	gboolean slow;
+	diskd_tp_burst_t *burst;
+
+	close(target->tp_fd);
+	target->tp_fd = -1;
+	target->tp_running = FALSE;
+	diskd_target_passive_rebase(target);
+
+	burst = malloc(sizeof(diskd_tp_burst_t));
+	if (burst != NULL) {
+		burst->time = target->tp_start;
+		burst->bytes = target->tp_bytes;
+		target->tp_history = g_list_append(target->tp_history, burst);
+	}
+
+	if (target->tp_failed || target->tp_bytes == 0 || elapsed <= 0) {
+		/* errors are left to the regular check */
+		crm_warn("throughput probe of %s failed after %lld bytes", target_name(target),
+			(long long)target->tp_bytes);
+		return;
+	}
+
+	target->tp_mbps = (double)target->tp_bytes / elapsed;	/* byte/us = MB/s */
+	target->tp_iops = (double)target->tp_done * G_TIME_SPAN_SECOND / elapsed;
+	slow = ((tp_min_mbps > 0 && target->tp_mbps < tp_min_mbps)
+		|| (tp_min_iops > 0 && target->tp_iops < tp_min_iops));
+	crm_info("throughput of %s: %.1fMB/s %.0fIOPS (%lld bytes in %lldms)",
+		target_name(target), target->tp_mbps, target->tp_iops,
+		(long long)target->tp_bytes, (long long)(elapsed / 1000));
+
+	if (slow == target->tp_slow) {
+		return;
+	}
+	target->tp_slow = slow;
+	if (slow) {
+		crm_warn("disk throughput is low, attr_name=%s, target=%s (%.1fMB/s %.0fIOPS)",
+			target->attr_name, target_name(target), target->tp_mbps, target->tp_iops);
+	} else {
+		crm_info("disk throughput is back to normal, attr_name=%s, target=%s",
+			target->attr_name, target_name(target));
+	}
+	if (target->value != NULL && strcmp(target->value, "ERROR") != 0) {
+		check_status(target, (target->slow || target->tp_slow)? degraded : normal);
+	}
+}
+
+static void diskd_tp_done(gpointer data, ssize_t result, int err)
+{
+	diskd_tp_slot_t *slot = data;
+	diskd_target_t *target = slot->target;
+
+	target->tp_inflight--;
+	if (result == tp_block) {
+		target->tp_bytes += result;
+		target->tp_done++;
+	} else if (target->tp_failed == FALSE) {
+		target->tp_failed = TRUE;
+		crm_warn("throughput probe %s on %s: %s", (target->wflag)? "write" : "read",
+			target_name(target), (result < 0)? strerror(err) : "short transfer");
+	}
+
+	if (target->tp_failed == FALSE
+	    && target->tp_next < target->tp_end
+	    && g_get_monotonic_time() < target->tp_start + tp_duration * G_TIME_SPAN_SECOND) {
+		diskd_tp_submit(slot);
+	}
+	if (target->tp_inflight == 0) {
+		diskd_tp_end(target);
+	}
+}
+
+static void diskd_tp_submit(diskd_tp_slot_t *slot)
+{
+	diskd_target_t *target = slot->target;
+	int rc;
+
+	rc = diskd_io_submit(target->tp_fd, target->wflag, slot->buf, tp_block, target->tp_next,
+		tp_duration, diskd_tp_done, slot);
+	if (rc < 0) {
+		crm_warn("Could not submit the throughput probe of %s: %s",
+			target_name(target), strerror(-rc));
+		target->tp_failed = TRUE;
+		return;
+	}
+	target->tp_next += tp_block;
+	target->tp_inflight++;
+}
+
+/* bytes of the bursts within the last hour */
+static gint64 diskd_tp_used(diskd_target_t *target)
+{
+	gint64 hour_ago = g_get_monotonic_time() - 3600 * G_TIME_SPAN_SECOND;
+	gint64 used = 0;
+	diskd_tp_burst_t *burst;
+	GList *gIter;
+
+	while (target->tp_history != NULL
+	       && (burst = target->tp_history->data)->time <= hour_ago) {
+		free(burst);
+		target->tp_history = g_list_delete_link(target->tp_history, target->tp_history);
+	}
+	for (gIter = target->tp_history; gIter != NULL; gIter = gIter->next) {
+		used += ((diskd_tp_burst_t *)gIter->data)->bytes;
+	}
+	return used;
+}
+
+static gboolean diskd_tp_tick(gpointer data)
+{
+	diskd_target_t *target = data;
+	gint64 used = diskd_tp_used(target);
+	off_t start = 0;
+	int i;
+
+	if (target->tp_running) {
+		return TRUE;
+	}
+	if ((target->value != NULL && strcmp(target->value, "ERROR") == 0)
+	    || target->mount_error != NULL) {
+		crm_debug("throughput probe of %s skipped, the disk is in error", target_name(target));
+		return TRUE;
+	}
+	if (used + tp_size > tp_budget) {
+		crm_info("throughput probe of %s skipped, %lld of %lld bytes used in the last hour",
+			target_name(target), (long long)used, (long long)tp_budget);
+		return TRUE;
+	}
+
+	if (target->wflag) {
+		target->tp_fd = open(target->tp_file, O_WRONLY | O_CREAT | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (target->tp_fd >= 0 && posix_fallocate(target->tp_fd, 0, tp_size) != 0) {
+			/* written blocks are allocated then, and the result is lower */
+			crm_debug("could not preallocate %s", target->tp_file);
+		}
+	} else {
+		target->tp_fd = open(target->device, O_RDONLY | O_DIRECT | O_NONBLOCK);
+		if (target->tp_fd >= 0) {
+			guint64 nblocks;
+
+			/* somewhere the array is unlikely to have in its cache */
+			diskd_target_getsize(target, target->tp_fd);
+			nblocks = target->dev_size / tp_block;
+			if (nblocks > (guint64)(tp_size / tp_block)) {
+				nblocks -= tp_size / tp_block;
+				start = (off_t)((((guint64)g_random_int() << 32) | g_random_int())
+						% nblocks) * tp_block;
+			}
+		}
+	}
+	if (target->tp_fd < 0) {
+		crm_perror(LOG_WARNING, "throughput probe of %s",
+			(target->wflag)? target->tp_file : target->device);
+		return TRUE;
+	}
+
+	target->tp_running = TRUE;
+	target->tp_failed = FALSE;
+	target->tp_bytes = 0;
+	target->tp_done = 0;
+	target->tp_inflight = 0;
+	target->tp_next = start;
+	target->tp_end = start + tp_size;
+	target->tp_start = g_get_monotonic_time();
+	for (i = 0; i < tp_depth && target->tp_next < target->tp_end; i++) {
+		diskd_tp_submit(&target->tp_slots[i]);
+		if (target->tp_failed) {
+			break;
+		}
+	}
+	if (target->tp_inflight == 0) {
+		diskd_tp_end(target);
+	}
+	return TRUE;
+}
+
+static void diskd_tp_start(diskd_target_t *target)
+{
+	int i;
+
+	if (posix_memalign(&target->tp_buf, pagesize, (size_t)tp_depth * tp_block) != 0) {
+		crm_err("Could not allocate memory for the throughput probe of %s",
+			target_name(target));
+		return;
+	}
+	memset(target->tp_buf, 0x5a, (size_t)tp_depth * tp_block);
+	target->tp_slots = calloc(tp_depth, sizeof(diskd_tp_slot_t));
+	if (target->tp_slots == NULL) {
+		crm_err("Could not allocate memory for the throughput probe of %s",
+			target_name(target));
+		return;
+	}
+	for (i = 0; i < tp_depth; i++) {
+		target->tp_slots[i].target = target;
+		target->tp_slots[i].buf = (unsigned char *)target->tp_buf + (size_t)i * tp_block;
+	}
+	if (target->wflag) {
+		target->tp_file = g_strdup_printf("%s-throughput", target->wfile);
+	}
+	target->tp_timer_id = g_timeout_add_seconds(tp_interval, diskd_tp_tick, target);
+}
+
+/*
+ * -b spec: interval=<s>,size=<MiB>,block=<KiB>,depth=<n>,duration=<s>,
+ * min-mbps=<MB/s>,min-iops=<n>,budget=<MiB per hour>
+ */
+static gboolean diskd_tp_parse(const char *spec)
+{
+	gchar **items = g_strsplit(spec, ",", 0);
+	int i, v;
+	int err = 0;
+
+	for (i = 0; items[i] != NULL; i++) {
+		char *key = items[i];
+		char *val = strchr(key, '=');
+
+		if (val == NULL || val[1] == '\0') {
+			crm_err("Invalid throughput item \"%s\" in \"%s\"", key, spec);
+			err++;
+			continue;
+		}
+		*val++ = '\0';
+		v = crm_parse_int(val, "-1");
+
+		if (strcmp(key, "interval") == 0) {
+			tp_interval = v;
+			if ((v < MIN_TP_INTERVAL) || (v > MAX_INTERVAL * 24))
+				err++;
+		} else if (strcmp(key, "size") == 0) {
+			tp_size = (gint64)v * 1024 * 1024;
+			if ((v < 1) || (v > MAX_TP_SIZE))
+				err++;
+		} else if (strcmp(key, "block") == 0) {
+			tp_block = v * 1024;
+			if ((v < 4) || (v > MAX_TP_BLOCK) || (tp_block % getpagesize() != 0))
+				err++;
+		} else if (strcmp(key, "depth") == 0) {
+			tp_depth = v;
+			if ((v < 1) || (v > MAX_TP_DEPTH))
+				err++;
+		} else if (strcmp(key, "duration") == 0) {
+			tp_duration = v;
+			if ((v < 1) || (v > MAX_TIMEOUT))
+				err++;
+		} else if (strcmp(key, "min-mbps") == 0) {
+			tp_min_mbps = v;
+			if (v < 1)
+				err++;
+		} else if (strcmp(key, "min-iops") == 0) {
+			tp_min_iops = v;
+			if (v < 1)
+				err++;
+		} else if (strcmp(key, "budget") == 0) {
+			tp_budget = (gint64)v * 1024 * 1024;
+			if (v < 1)
+				err++;
+		} else {
+			crm_err("Unknown throughput item \"%s\" in \"%s\"", key, spec);
+			err++;
+		}
+	}
+	g_strfreev(items);
+
+	if (tp_min_mbps <= 0 && tp_min_iops <= 0) {
+		crm_err("throughput probe \"%s\" needs min-mbps or min-iops", spec);
+		err++;
+	}
+	if (tp_size > tp_budget || tp_size % tp_block != 0) {
+		crm_err("throughput probe size must be a multiple of block and within budget");
+		err++;
+	}
+	return (err == 0);
+}
+
+/* One write attempt of the disk check. Returns normal or ERROR. */
+static int diskcheck_wt_attempt(diskd_target_t *target)
+{
+	const char *wfile = target->wfile;
+	int fd = -1;
+	int err;
+	int select_err;
+	struct timeval timeout_tv;
+	fd_set write_fd_set;
+	gint64 t;
+	int wlen = diskd_write_len(target);
+	void *wbuf;
+
+	/* file open */
+	t = g_get_monotonic_time();
+	fd = diskd_target_open(target);
+	if (fd == -1) {
+		crm_err("Could not open %s", wfile);
+		crm_perror(LOG_ERR, "%s", wfile);
+		return ERROR;  /* failed to open file. try re-open */
+	}
+	t = diskd_target_lat(target, DISKD_LAT_OPEN, t);
+
+	target->woff = diskd_target_woffset(target);
+	wbuf = diskd_target_wbuf(target);
+	while( 1 ) {
+		err = pwrite(fd, wbuf, wlen, target->woff);  /* data write */
+		if (err == wlen) {
+			crm_trace("data writing is OK");
+			t = diskd_target_lat(target, DISKD_LAT_IO, t);
+			if (verify_flag && diskd_target_verify(target, fd, target->woff, t) == FALSE) {
+				diskd_target_close(target, fd, TRUE);
+				return ERROR;
+			}
+			diskd_target_close(target, fd, FALSE);
+			return normal;  /* OK */
+		} else if (err != wlen && errno == EAGAIN) {
+			crm_warn("write function return errno:EAGAIN");
+			FD_ZERO(&write_fd_set);
+			FD_SET(fd, &write_fd_set);
+			timeout_tv.tv_sec = target->timeout;
+			timeout_tv.tv_usec = 0;
+			select_err = select(fd+1, NULL, &write_fd_set, NULL, &timeout_tv);
+			if (select_err == 1) {
+				crm_warn("select ok, write again");
+				continue;  /* retly write */
+			} else if (select_err == -1) {
+				crm_err("select failed on file %s", wfile);
+				diskd_target_close(target, fd, TRUE);
+				return ERROR;  /* failed to select */
+			} else {
+				crm_err("select time out on file %s", wfile);
+				diskd_target_close(target, fd, TRUE);
+				errno = ETIMEDOUT;
+				return ERROR;  /* failed to select */
+			}
+		} else {
+			crm_err("Could not write to file %s", wfile);
+			crm_perror(LOG_ERR, "%s", wfile);
+			diskd_target_lat(target, DISKD_LAT_IO, t);
+			diskd_target_close(target, fd, TRUE);
+			return ERROR;  /* failed to write */
+		}
+	}
+}
+
+/* One read attempt of the disk check. Returns normal or ERROR. */
+static int diskcheck_attempt(diskd_target_t *target)
+{
+	const char *device = target->device;
+	int fd = -1;
+	int err;
+	int select_err;
+	struct timeval timeout_tv;
+	fd_set read_fd_set;
+	gint64 t;
+
+	t = g_get_monotonic_time();
+	fd = diskd_target_open(target);
+	if (fd == -1) {
+		crm_err("Could not open device %s", device);
+		return ERROR;
+	}
+	t = diskd_target_lat(target, DISKD_LAT_OPEN, t);
+
+	while( 1 ) {
+		err = diskd_target_read(target, fd, diskd_target_roffset(target), probe_size);
+		if (err == probe_size) {
+			crm_trace("reading form data is OK");
+			diskd_target_lat(target, DISKD_LAT_IO, t);
+			diskd_target_close(target, fd, FALSE);
+			return normal;
+		} else if (err != probe_size && errno == EAGAIN) {
+			crm_warn("read function return errno:EAGAIN");
+			FD_ZERO(&read_fd_set);
+			FD_SET(fd, &read_fd_set);
+			timeout_tv.tv_sec = target->timeout;
+			timeout_tv.tv_usec = 0;
+			select_err = select(fd+1, &read_fd_set, NULL, NULL, &timeout_tv);
+			if (select_err == 1) {
+				crm_warn("select ok, read again");
+				continue;
+			} else if (select_err == -1) {
+				crm_err("select failed on device %s", device);
+				diskd_target_close(target, fd, TRUE);
+				return ERROR;
+			}
+		} else {
+			crm_err("Could not read from device %s", device);
+			diskd_target_lat(target, DISKD_LAT_IO, t);
+			diskd_target_close(target, fd, TRUE);
+			return ERROR;
+		}
+	}
+}
+
+/*
+ * Blocking disk check, used when no asynchronous I/O engine is available.
+ * Only the I/O itself blocks the main loop: a retry is a main loop timer
+ * (diskcheck_sync_retry), so signals, attrd and the other targets are
+ * served in between. With the watchdog (-e) the attempt runs on the
+ * checker thread of the target and does not block the main loop at all,
+ * so the ERROR set at the deadline reaches attrd while the I/O hangs. In oneshot mode there is
+ * no main loop, the retries wait in place.
+ */
+static int diskcheck_sync_step(diskd_target_t *target);
+
+static gboolean
+diskcheck_sync_retry(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	target->retry_id = 0;
+	diskcheck_sync_step(target);
+	return FALSE;
+}
+
+static int diskcheck_sync_done(diskd_target_t *target, int rc, int err)
+{
+	gint64 t;
+
+	diskd_watchdog_disarm(target);
+	if (rc == normal) {
+		t = diskd_target_lat(target, DISKD_LAT_TOTAL, target->check_start);
+		target->in_flight = FALSE;
+		diskd_target_finish(target, diskd_target_grade(target, t - target->check_start),
+			target->attempt > 0);
+		return normal;
+	}
+	diskd_target_count_error(target, (err != 0)? err : EIO);
+	if (target->attempt < target->retry) {
+		target->attempt++;
+		target->n_retries++;
+		if (oneshot_flag == 0) {
+			target->retry_id = g_timeout_add(target->retry_interval * 1000,
+				diskcheck_sync_retry, target);
+			return ERROR;
+		}
+		sleep(target->retry_interval);
+		return diskcheck_sync_step(target);
+	}
+
+	target->in_flight = FALSE;
+	crm_warn("Error(s) occurred in %s function.", (target->wflag)? "diskcheck_wt" : "diskcheck");
+	diskd_target_finish(target, ERROR, TRUE);
+	return ERROR;
+}
+
+static gboolean
+diskcheck_sync_thread_done(gpointer data)
+{
+	diskd_target_t *target = data;
+	int rc, err;
+
+	diskd_lock();
+	rc = (int)target->th_result;
+	err = target->th_err;
+	diskd_unlock();
+	target->th_running = FALSE;
+	diskcheck_sync_done(target, rc, err);
+	return FALSE;
+}
+
+/*
+ * Checker thread of a target (-e). The blocking steps of its checks (the
+ * sync attempt, the read with FUA) run there one after the other while
+ * the main loop goes on. It lives as long as the daemon, and a hung disk
+ * holds only the thread of its own target.
+ */
+#define CHECK_JOB_SYNC		1	/* diskcheck_(wt_)attempt() */
+#define CHECK_JOB_SG		2	/* the read with FUA at th_offset */
+#define CHECK_JOB_STOP		3
+
+static gboolean diskcheck_sg_done(gpointer data);
+
+static gpointer
+diskd_checker_thread(gpointer data)
+{
+	diskd_target_t *target = data;
+	GAsyncQueue *jobs = target->th_jobs;
+	ssize_t result;
+	int job;
+	int err;
+
+	while ((job = GPOINTER_TO_INT(g_async_queue_pop(jobs))) != CHECK_JOB_STOP) {
+		if (job == CHECK_JOB_SG) {
+			result = diskd_target_read(target, target->fd, target->th_offset, probe_size);
+		} else {
+			result = (target->wflag)? diskcheck_wt_attempt(target) : diskcheck_attempt(target);
+		}
+		err = errno;
+		diskd_lock();
+		target->th_result = result;
+		target->th_err = err;
+		diskd_unlock();
+		g_idle_add((job == CHECK_JOB_SG)? diskcheck_sg_done : diskcheck_sync_thread_done, target);
+	}
+	g_async_queue_unref(jobs);
+	return NULL;
+}
+
+/* Hand job to the checker thread of target. FALSE: there is none. */
+static gboolean diskd_checker_run(diskd_target_t *target, int job)
+{
+	if (diskd_thread_use == FALSE || oneshot_flag) {
+		return FALSE;
+	}
+	if (target->th_jobs == NULL) {
+		target->th_jobs = g_async_queue_new();
+		/* the thread holds the second reference */
+		g_async_queue_ref(target->th_jobs);
+		if (diskd_thread_start("check", diskd_checker_thread, target) == FALSE) {
+			g_async_queue_unref(target->th_jobs);
+			g_async_queue_unref(target->th_jobs);
+			target->th_jobs = NULL;
+			return FALSE;
+		}
+	}
+	target->th_running = TRUE;
+	g_async_queue_push(target->th_jobs, GINT_TO_POINTER(job));
+	return TRUE;
+}
+
+static void diskd_checker_stop(diskd_target_t *target)
+{
+	if (target->th_jobs != NULL) {
+		g_async_queue_push(target->th_jobs, GINT_TO_POINTER(CHECK_JOB_STOP));
+		g_async_queue_unref(target->th_jobs);
+		target->th_jobs = NULL;
+	}
+}
+
+static int diskcheck_sync_step(diskd_target_t *target)
+{
+	int rc;
+
+	diskd_watchdog_arm(target);
+	if (diskd_checker_run(target, CHECK_JOB_SYNC)) {
+		return normal;
+	}
+	rc = (target->wflag)? diskcheck_wt_attempt(target) : diskcheck_attempt(target);
+	return diskcheck_sync_done(target, rc, errno);
+}
+
+static int diskcheck_sync(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	if (target->in_flight) {
+		crm_warn("The previous check of %s is still in progress. skipped.",
+			target_name(target));
+		return TRUE;
+	}
+
+	crm_trace("%s start", (target->wflag)? "diskcheck_wt" : "diskcheck");
+	if (diskd_target_passive(target)) {
+		return TRUE;
+	}
+	diskd_paths_start(target);
+
+	target->in_flight = TRUE;
+	target->attempt = 0;
+	target->check_start = g_get_monotonic_time();
+	return diskcheck_sync_step(target);
+}
+
+/*
+ * Asynchronous disk check. The I/O is handed to the I/O engine and its
+ * result comes back to diskcheck_async_done() on the main loop; retries
+ * are main loop timers, so a hung disk never blocks the daemon.
+ */
+static void diskcheck_async_attempt(diskd_target_t *target);
+
+static gboolean
+diskcheck_async_retry(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	target->retry_id = 0;
+	diskcheck_async_attempt(target);
+	return FALSE;
+}
+
+static void
+diskcheck_async_failed(diskd_target_t *target, int err)
+{
+	diskd_target_count_error(target, err);
+	if (target->attempt < target->retry) {
+		target->attempt++;
+		target->n_retries++;
+		target->retry_id = g_timeout_add(target->retry_interval * 1000,
+			diskcheck_async_retry, target);
+		return;
+	}
+
+	target->in_flight = FALSE;
+	crm_warn("Error(s) occurred in %s function.", (target->wflag)? "diskcheck_wt" : "diskcheck");
+	diskd_target_finish(target, ERROR, TRUE);
+}
+
+static void
+diskcheck_async_done(gpointer data, ssize_t result, int err)
+{
+	diskd_target_t *target = data;
+	ssize_t len = (target->wflag)? diskd_write_len(target) : probe_size;
+	gint64 now;
+	int rc;
+
+	if (target->verify_io) {
+		target->verify_io = FALSE;
+		diskd_target_lat(target, DISKD_LAT_VERIFY, target->io_start);
+		if (result >= 0 && diskd_block_verify(target, result) == FALSE) {
+			result = -1;
+			err = EILSEQ;
+		}
+	} else {
+		now = diskd_target_lat(target, DISKD_LAT_IO, target->io_start);
+		if (result == len && target->wflag && verify_flag) {
+			/* read it back */
+			target->verify_io = TRUE;
+			target->io_start = now;
+			rc = (diskd_target_wdirect(target)? diskd_io_submit : diskd_io_submit_buffered)
+				(target->fd, FALSE, (unsigned char *)target->vblock + pagesize,
+				pagesize, target->woff, target->timeout, diskcheck_async_done, target);
+			if (rc == 0) {
+				return;
+			}
+			target->verify_io = FALSE;
+			result = -1;
+			err = -rc;
+		}
+	}
+	diskd_target_close(target, target->fd, (result != len));
+
+	if (result == len) {
+		crm_trace("%s %s is OK", (target->wflag)? "writing to" : "reading from",
+			target_name(target));
+		now = diskd_target_lat(target, DISKD_LAT_TOTAL, target->check_start);
+		target->in_flight = FALSE;
+		diskd_target_finish(target, diskd_target_grade(target, now - target->check_start),
+			target->attempt > 0);
+		return;
+	}
+
+	if (err == EILSEQ) {
+		/* reported by diskd_block_verify() */
+	} else if (err == ETIMEDOUT) {
+		crm_err("%s time out on %s", (target->wflag)? "write" : "read",
+			(target->wflag)? target->wfile : target->device);
+	} else {
+		crm_err("Could not %s %s: %s", (target->wflag)? "write to file" : "read from device",
+			(target->wflag)? target->wfile : target->device,
+			(result < 0)? strerror(err) : "short transfer");
+	}
+	diskcheck_async_failed(target, (result < 0)? err : EIO);
+}
+
+static gboolean
+diskcheck_sg_done(gpointer data)
+{
+	diskd_target_t *target = data;
+	ssize_t result;
+	int err;
+
+	diskd_lock();
+	result = target->th_result;
+	err = target->th_err;
+	diskd_unlock();
+	target->th_running = FALSE;
+	diskd_watchdog_disarm(target);
+	diskcheck_async_done(target, result, (result < 0)? err : 0);
+	return FALSE;
+}
+
+static void
+diskcheck_async_attempt(diskd_target_t *target)
+{
+	int fd;
+	int rc;
+	gint64 t = g_get_monotonic_time();
+
+	/* open() and the submission may still block */
+	diskd_watchdog_arm(target);
+	fd = diskd_target_open(target);
+	rc = errno;
+	diskd_watchdog_disarm(target);
+	if (fd == -1) {
+		crm_err("Could not open %s", (target->wflag)? target->wfile : target->device);
+		crm_perror(LOG_ERR, "%s", (target->wflag)? target->wfile : target->device);
+		diskcheck_async_failed(target, rc);
+		return;
+	}
+	target->io_start = diskd_target_lat(target, DISKD_LAT_OPEN, t);
+
+	if (target->wflag == FALSE && bypass_cache_flag && target->sg_unsupported == FALSE) {
+		/*
+		 * SG_IO has no asynchronous form. It is bounded by the SCSI
+		 * timeout; with the watchdog (-e) it runs on the checker thread,
+		 * so a hung driver does not block the main loop either.
+		 */
+		target->fd = fd;
+		target->th_offset = diskd_target_roffset(target);
+		diskd_watchdog_arm(target);
+		if (diskd_checker_run(target, CHECK_JOB_SG) == FALSE) {
+			target->th_result = diskd_target_read(target, fd, target->th_offset, probe_size);
+			target->th_err = errno;
+			diskcheck_sg_done(target);
+		}
+		return;
+	}
+
+	if (target->wflag) {
+		target->woff = diskd_target_woffset(target);
+		rc = (diskd_target_wdirect(target)? diskd_io_submit : diskd_io_submit_buffered)
+			(fd, TRUE, diskd_target_wbuf(target), diskd_write_len(target),
+			target->woff, target->timeout, diskcheck_async_done, target);
+	} else {
+		rc = diskd_io_submit(fd, FALSE, target->iobuf, probe_size, diskd_target_roffset(target),
+			target->timeout, diskcheck_async_done, target);
+	}
+	if (rc < 0) {
+		crm_err("Could not submit the disk check of %s: %s",
+			target_name(target), strerror(-rc));
+		diskd_target_close(target, fd, TRUE);
+		diskcheck_async_failed(target, -rc);
+		return;
+	}
+	target->fd = fd;
+}
+
+static int diskcheck_async(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	if (target->in_flight) {
+		crm_warn("The previous check of %s is still in progress. skipped.",
+			target_name(target));
+		return TRUE;
+	}
+
+	crm_trace("diskcheck_async start");
+	if (diskd_target_passive(target)) {
+		return TRUE;
+	}
+	diskd_paths_start(target);
+
+	target->in_flight = TRUE;
+	target->attempt = 0;
+	target->check_start = g_get_monotonic_time();
+	diskcheck_async_attempt(target);
+	return TRUE;
+}
+
+static int diskd_target_check(diskd_target_t *target)
+{
+	return diskcheck_sync(target);
+}
+
+static int oneshot(void)
+{
+	int rc = 0;
+	GList *gIter;
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		if (diskd_target_check(gIter->data) == ERROR) {
+			rc = ERROR;
+		}
+	}
+
+	if (rc == ERROR) {
+		return ERROR;
+	}
+	return 0;
+}
+
+static diskd_target_t *
+diskd_target_new(const char *attr_name)
+{
+	diskd_target_t *target = calloc(1, sizeof(diskd_target_t));
+	int i;
+
+	if (target == NULL) {
+		crm_err("Could not allocate memory");
+		crm_exit(1);
+	}
+	target->attr_name = strdup(attr_name);
+	target->interval = -1;
+	target->timeout = -1;
+	target->retry = -1;
+	target->retry_interval = -1;
+	target->slow_threshold = -1;
+	target->slow_clear = -1;
+	target->min_interval = -1;
+	target->max_interval = -1;
+	target->ewma = -1;
+	target->fd = -1;
+	target->tp_fd = -1;
+	target->wd_index = -1;
+	for (i = 0; i < DISKD_LAT_PHASES; i++) {
+		target->lat_last[i] = -1;
+	}
+	target->rnd_state = ((guint64)g_random_int() << 32) | g_random_int() | 1;
+	target->paths_rnd_state = ((guint64)g_random_int() << 32) | g_random_int() | 1;
+#if ATTRD_UPDATE_BOTH
+	target->first_update = TRUE;
+	target->paths_first_update = TRUE;
+	target->health_first_update = TRUE;
+#endif
+	return target;
+}
+
+static void
+diskd_target_set_wdir(diskd_target_t *target, const char *dir)
+{
+	target->wflag = TRUE;
+	target->wdir = strdup(dir);
+	target->wfile = calloc(1, PATH_MAX);
+	g_snprintf(target->wfile, PATH_MAX, "%s/%s", dir, WRITE_FILE);
+}
+
+static void
+diskd_target_free(gpointer data)
+{
+	diskd_target_t *target = data;
+
+	if (target->th_running) {
+		/* the checker thread still refers to it */
+		return;
+	}
+	diskd_checker_stop(target);
+	if (target->fd >= 0) {
+		close(target->fd);
+		if (target->wflag && -1 == remove((const char *)target->wfile)) {
+			crm_warn("failed to remove file %s", target->wfile);
+		}
+	}
+	if (target->tp_file != NULL) {
+		unlink(target->tp_file);
+		g_free(target->tp_file);
+	}
+	if (target->tp_fd >= 0) {
+		close(target->tp_fd);
+	}
+	g_list_free_full(target->tp_history, free);
+	free(target->tp_slots);
+	free(target->tp_buf);
+	g_list_free_full(target->paths, diskd_path_free);
+	free(target->paths_attr);
+	free(target->health_attr);
+	free(target->stat_path);
+	free(target->vblock);
+	free(target->iobuf);
+	g_list_free_full(target->knames, free);
+	free(target->attr_name);
+	free(target->device);
+	free(target->wdir);
+	free(target->wfile);
+	free(target);
+}
+
+/*
+ * Parse a "-T" target spec:
+ *   attr=<name>,(device=<device>|write-dir=<directory>)
+ *   [,interval=<s>][,timeout=<s>][,retry=<n>][,retry-interval=<s>]
+ * Returns NULL when the spec is malformed.
+ */
+static diskd_target_t *
+diskd_target_parse(const char *spec)
+{
+	diskd_target_t *target = NULL;
+	gchar **items = g_strsplit(spec, ",", 0);
+	const char *attr_name = NULL;
+	const char *dev = NULL;
+	const char *dir = NULL;
+	int t_interval = -1, t_timeout = -1, t_retry = -1, t_retry_interval = -1;
+	int t_slow_threshold = -1, t_slow_clear = -1;
+	int t_min_interval = -1, t_max_interval = -1;
+	int i;
+	int err = 0;
+
+	for (i = 0; items[i] != NULL; i++) {
+		char *key = items[i];
+		char *val = strchr(key, '=');
+
+		if (val == NULL || val[1] == '\0') {
+			crm_err("Invalid target item \"%s\" in \"%s\"", key, spec);
+			err++;
+			continue;
+		}
+		*val++ = '\0';
+
+		if (strcmp(key, "attr") == 0) {
+			attr_name = val;
+		} else if (strcmp(key, "device") == 0) {
+			dev = val;
+		} else if (strcmp(key, "write-dir") == 0) {
+			dir = val;
+		} else if (strcmp(key, "interval") == 0) {
+			t_interval = crm_parse_int(val, "-1");
+			if ((t_interval < MIN_INTERVAL) || (t_interval > MAX_INTERVAL))
+				err++;
+		} else if (strcmp(key, "timeout") == 0) {
+			t_timeout = crm_parse_int(val, "-1");
+			if ((t_timeout < MIN_TIMEOUT) || (t_timeout > MAX_TIMEOUT))
+				err++;
+		} else if (strcmp(key, "retry") == 0) {
+			t_retry = crm_parse_int(val, "-1");
+			if ((t_retry < MIN_RETRY) || (t_retry > MAX_RETRY))
+				err++;
+		} else if (strcmp(key, "retry-interval") == 0) {
+			t_retry_interval = crm_parse_int(val, "-1");
+			if ((t_retry_interval < MIN_RETRY_INTERVAL) || (t_retry_interval > MAX_RETRY_INTERVAL))
+				err++;
+		} else if (strcmp(key, "slow-threshold") == 0) {
+			t_slow_threshold = crm_parse_int(val, "-1");
+			if ((t_slow_threshold < MIN_SLOW_THRESHOLD) || (t_slow_threshold > MAX_SLOW_THRESHOLD))
+				err++;
+		} else if (strcmp(key, "min-interval") == 0) {
+			t_min_interval = crm_parse_int(val, "-1");
+			if ((t_min_interval < MIN_ADAPT_INTERVAL) || (t_min_interval > MAX_INTERVAL * 1000))
+				err++;
+		} else if (strcmp(key, "max-interval") == 0) {
+			t_max_interval = crm_parse_int(val, "-1");
+			if ((t_max_interval < MIN_INTERVAL) || (t_max_interval > MAX_INTERVAL))
+				err++;
+		} else if (strcmp(key, "slow-clear") == 0) {
+			t_slow_clear = crm_parse_int(val, "-1");
+			if ((t_slow_clear < MIN_SLOW_THRESHOLD) || (t_slow_clear > MAX_SLOW_THRESHOLD))
+				err++;
+		} else {
+			crm_err("Unknown target item \"%s\" in \"%s\"", key, spec);
+			err++;
+		}
+	}
+
+	if (attr_name == NULL || (dev == NULL && dir == NULL) || (dev != NULL && dir != NULL)) {
+		crm_err("Target \"%s\" needs attr and one of device or write-dir", spec);
+		err++;
+	}
+
+	if (err == 0) {
+		target = diskd_target_new(attr_name);
+		if (dev != NULL) {
+			target->device = strdup(dev);
+		} else {
+			diskd_target_set_wdir(target, dir);
+		}
+		target->interval = t_interval;
+		target->timeout = t_timeout;
+		target->retry = t_retry;
+		target->retry_interval = t_retry_interval;
+		target->slow_threshold = t_slow_threshold;
+		target->slow_clear = t_slow_clear;
+		target->min_interval = t_min_interval;
+		target->max_interval = t_max_interval;
+	}
+
+	g_strfreev(items);
+	return target;
+}
+
+/* Fill the values not given in the target spec from the global options */
+static gboolean
+diskd_target_resolve(void)
+{
+	GList *gIter, *gIter2;
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (target->interval < 0) target->interval = interval;
+		if (target->timeout < 0) target->timeout = timeout;
+		if (target->retry < 0) target->retry = retry;
+		if (target->retry_interval < 0) target->retry_interval = retry_interval;
+		if (target->slow_threshold < 0) target->slow_threshold = slow_threshold;
+		if (target->slow_clear < 0) target->slow_clear = slow_clear;
+		if (target->slow_clear < 0 || target->slow_clear > target->slow_threshold) {
+			target->slow_clear = target->slow_threshold * 8 / 10;
+		}
+		if (target->min_interval < 0) target->min_interval = min_interval;
+		if (target->max_interval < 0) target->max_interval = max_interval;
+		if (target->min_interval < 0) target->min_interval = target->interval * 1000;
+		if (target->max_interval < 0) target->max_interval = target->interval;
+		if (target->min_interval > target->interval * 1000
+		    || target->max_interval < target->interval) {
+			crm_err("interval of %s must be between min-interval and max-interval",
+				target_name(target));
+			return FALSE;
+		}
+		target->cur_interval = target->interval * 1000;
+
+		for (gIter2 = gIter->next; gIter2 != NULL; gIter2 = gIter2->next) {
+			diskd_target_t *other = gIter2->data;
+
+			if (strcmp(target->attr_name, other->attr_name) == 0) {
+				crm_err("attr_name %s is used by two or more targets", target->attr_name);
+				return FALSE;
+			}
+			if (target->wflag && other->wflag && strcmp(target->wfile, other->wfile) == 0) {
+				crm_err("write directory %s is used by two or more targets", target->wdir);
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Metrics in the OpenMetrics text format (stats socket request
+ * "metrics"), or in the Prometheus text format for the textfile
+ * collector (-x). The two differ only in the name on the TYPE line of a
+ * counter and in the "# EOF" terminator.
+ */
+static const struct {
+	const char *name;
+	const char *help;
+	glong offset;
+} metrics_counters[] = {
+	{ "diskd_checks", "Finished disk checks",
+	  G_STRUCT_OFFSET(diskd_target_t, n_checks) },
+	{ "diskd_check_failures", "Disk checks that ended in ERROR",
+	  G_STRUCT_OFFSET(diskd_target_t, n_failures) },
+	{ "diskd_retries", "Retried disk check attempts",
+	  G_STRUCT_OFFSET(diskd_target_t, n_retries) },
+	{ "diskd_timeouts", "Disk check attempts past the check timeout",
+	  G_STRUCT_OFFSET(diskd_target_t, n_timeouts) },
+	{ "diskd_state_transitions", "Changes of the attribute value",
+	  G_STRUCT_OFFSET(diskd_target_t, n_transitions) },
+	{ "diskd_attrd_update_failures", "Attribute updates attrd did not accept",
+	  G_STRUCT_OFFSET(diskd_target_t, n_attrd_failures) },
+};
+
+/* upper bounds of the latency histogram [s] */
+static const double metrics_le[] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05,
+	0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+};
+
+/* A bucket bound as OpenMetrics wants it: "1.0", not "1" or "1e+00" */
+static const char *metrics_le_str(double le, char *str, size_t len)
+{
+	snprintf(str, len, "%.6f", le);
+	/* trailing zeros go, one digit after the point stays */
+	while (strlen(str) > 2 && str[strlen(str) - 1] == '0' && str[strlen(str) - 2] != '.') {
+		str[strlen(str) - 1] = '\0';
+	}
+	return str;
+}
+
+static void metrics_labels(GString *out, diskd_target_t *target)
+{
+	const char *values[2] = { target->attr_name, target_name(target) };
+	const char *p;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		g_string_append(out, (i == 0)? "attr_name=\"" : ",target=\"");
+		for (p = values[i]; *p != '\0'; p++) {
+			if (*p == '\\' || *p == '"') {
+				g_string_append_c(out, '\\');
+				g_string_append_c(out, *p);
+			} else if (*p == '\n') {
+				g_string_append(out, "\\n");
+			} else {
+				g_string_append_c(out, *p);
+			}
+		}
+		g_string_append_c(out, '"');
+	}
+}
+
+static void metrics_family(GString *out, const char *name, const char *type,
+			   const char *help, gboolean om)
+{
+	const char *suffix = (om == FALSE && strcmp(type, "counter") == 0)? "_total" : "";
+
+	g_string_append_printf(out, "# TYPE %s%s %s\n", name, suffix, type);
+	g_string_append_printf(out, "# HELP %s%s %s\n", name, suffix, help);
+}
+
+static void diskd_metrics(GString *out, gboolean om)
+{
+	static const char *states[] = { "normal", "degraded", "ERROR" };
+	GList *gIter;
+	char le[32];
+	size_t c;
+	int i, phase;
+
+	metrics_family(out, "diskd_target_state", "gauge",
+		"Current attribute value of the target (1: this value)", om);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		for (i = 0; i < 3; i++) {
+			g_string_append(out, "diskd_target_state{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, ",state=\"%s\"} %d\n", states[i],
+				(target->value != NULL && strcmp(target->value, states[i]) == 0));
+		}
+	}
+
+	for (c = 0; c < G_N_ELEMENTS(metrics_counters); c++) {
+		metrics_family(out, metrics_counters[c].name, "counter", metrics_counters[c].help, om);
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			diskd_target_t *target = gIter->data;
+
+			g_string_append_printf(out, "%s_total{", metrics_counters[c].name);
+			metrics_labels(out, target);
+			g_string_append_printf(out, "} %llu\n", (unsigned long long)
+				G_STRUCT_MEMBER(guint64, target, metrics_counters[c].offset));
+		}
+	}
+
+	metrics_family(out, "diskd_io_errors", "counter", "Failed disk check attempts by errno", om);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		for (i = 0; i < ERRNO_SLOTS && target->n_errnos[i].count > 0; i++) {
+			g_string_append(out, "diskd_io_errors_total{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, ",errno=\"%s\"} %llu\n",
+				(target->n_errnos[i].err < 0)? "other" : diskd_errno_name(target->n_errnos[i].err),
+				(unsigned long long)target->n_errnos[i].count);
+		}
+	}
+
+	metrics_family(out, "diskd_check_interval_seconds", "gauge", "Current check interval", om);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append(out, "diskd_check_interval_seconds{");
+		metrics_labels(out, target);
+		g_string_append_printf(out, "} %.3f\n", target->cur_interval / 1000.0);
+	}
+
+	metrics_family(out, "diskd_check_latency_seconds", "histogram",
+		"Latency of the disk check phases", om);
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		diskd_lock();
+		for (phase = 0; phase < DISKD_LAT_PHASES; phase++) {
+			const diskd_hist_t *hist = &target->lat[phase].cumulative;
+
+			if (hist->n == 0) {
+				continue;
+			}
+			for (c = 0; c < G_N_ELEMENTS(metrics_le); c++) {
+				g_string_append(out, "diskd_check_latency_seconds_bucket{");
+				metrics_labels(out, target);
+				g_string_append_printf(out, ",phase=\"%s\",le=\"%s\"} %llu\n",
+					diskd_lat_phase_name(phase),
+					metrics_le_str(metrics_le[c], le, sizeof(le)), (unsigned long long)
+					diskd_hist_count_le(hist, (gint64)(metrics_le[c] * G_TIME_SPAN_SECOND)));
+			}
+			g_string_append(out, "diskd_check_latency_seconds_bucket{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, ",phase=\"%s\",le=\"+Inf\"} %llu\n",
+				diskd_lat_phase_name(phase), (unsigned long long)hist->n);
+			g_string_append(out, "diskd_check_latency_seconds_count{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, ",phase=\"%s\"} %llu\n",
+				diskd_lat_phase_name(phase), (unsigned long long)hist->n);
+			g_string_append(out, "diskd_check_latency_seconds_sum{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, ",phase=\"%s\"} %.6f\n",
+				diskd_lat_phase_name(phase), (double)hist->sum / G_TIME_SPAN_SECOND);
+		}
+		diskd_unlock();
+	}
+
+	if (throughput_flag) {
+		metrics_family(out, "diskd_throughput_bytes_per_second", "gauge",
+			"Result of the last throughput probe", om);
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			diskd_target_t *target = gIter->data;
+
+			g_string_append(out, "diskd_throughput_bytes_per_second{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, "} %.0f\n", target->tp_mbps * 1000000);
+		}
+		metrics_family(out, "diskd_throughput_iops", "gauge",
+			"Result of the last throughput probe", om);
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			diskd_target_t *target = gIter->data;
+
+			g_string_append(out, "diskd_throughput_iops{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, "} %.0f\n", target->tp_iops);
+		}
+	}
+
+	if (health_flag) {
+		metrics_family(out, "diskd_health_predicted_failure", "gauge",
+			"A disk of the target predicts its failure (health log)", om);
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			diskd_target_t *target = gIter->data;
+
+			if (target->health.state == DISKD_HEALTH_UNKNOWN) {
+				continue;
+			}
+			g_string_append(out, "diskd_health_predicted_failure{");
+			metrics_labels(out, target);
+			g_string_append_printf(out, "} %d\n",
+				(target->health.state == DISKD_HEALTH_FAILING));
+		}
+	}
+
+	if (om) {
+		g_string_append(out, "# EOF\n");
+	}
+}
+
+static gboolean diskd_metrics_write(gpointer data)
+{
+	GString *out = g_string_sized_new(8192);
+
+	diskd_metrics(out, FALSE);
+	diskd_stats_write_file(metrics_file, out);
+	g_string_free(out, TRUE);
+	return TRUE;
+}
+
+/*
+ * Answer of the stats socket. "status" gets the target lines only,
+ * "metrics" the OpenMetrics exposition, "" (the client sent nothing) and
+ * "stats" the whole report.
+ */
+static void
+diskd_stats_report(const char *request, GString *out)
+{
+	GList *gIter, *gIter2;
+	diskd_lat_summary_t sum;
+	int phase, window;
+	gboolean brief = (strcmp(request, "status") == 0);
+
+	if (strcmp(request, "metrics") == 0) {
+		diskd_metrics(out, TRUE);
+		return;
+	}
+	if (!brief && request[0] != '\0' && strcmp(request, "stats") != 0) {
+		g_string_append_printf(out, "error unknown request %s\n", request);
+		return;
+	}
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append_printf(out, "target attr_name=%s %s=%s status=%s\n",
+			target->attr_name, (target->wflag)? "write-dir" : "device",
+			target_name(target), (target->value)? target->value : "unknown");
+		if (brief) {
+			continue;
+		}
+		g_string_append_printf(out, "  schedule interval=%dms min=%dms max=%ds phase=%.3f\n",
+			target->cur_interval, target->min_interval, target->max_interval, target->phase);
+		if (target->p_valid) {
+			g_string_append_printf(out, "  passive in_flight=%u service=%.2fms%s\n",
+				target->p_inflight, target->p_service,
+				(target->hang_since != 0)? " stalled" : "");
+		}
+		if (target->paths_attr != NULL) {
+			g_string_append_printf(out, "  paths %s=%s\n",
+				target->paths_attr, target->paths_value);
+		}
+		if (target->mount_error != NULL) {
+			g_string_append_printf(out, "  file system %s\n", target->mount_error);
+		}
+		if (target->health_attr != NULL) {
+			g_string_append_printf(out,
+				"  health %s=%s backend=%s temperature=%d wear=%d defects=%lld%s%s\n",
+				target->health_attr, (target->health_value[0])? target->health_value : "unknown",
+				(target->health.backend)? target->health.backend : "none",
+				target->health.temperature, target->health.wear,
+				(long long)target->health.defects,
+				(target->health.reason[0])? " reason=" : "", target->health.reason);
+		}
+		if (target->tp_slots != NULL) {
+			g_string_append_printf(out,
+				"  throughput mbps=%.1f iops=%.0f%s used=%lldMiB/h\n",
+				target->tp_mbps, target->tp_iops, (target->tp_slow)? " low" : "",
+				(long long)(diskd_tp_used(target) / (1024 * 1024)));
+		}
+
+		for (phase = 0; phase < DISKD_LAT_PHASES; phase++) {
+			for (window = 0; window <= 1; window++) {
+				diskd_lock();
+				diskd_lat_summary(&target->lat[phase], window, &sum);
+				diskd_unlock();
+				g_string_append_printf(out,
+					"  %-5s %-10s count=%llu p50=%lldus p99=%lldus p999=%lldus max=%lldus\n",
+					diskd_lat_phase_name(phase), (window)? "window" : "cumulative",
+					(unsigned long long)sum.n, (long long)sum.p50, (long long)sum.p99,
+					(long long)sum.p999, (long long)sum.max);
+			}
+		}
+		for (gIter2 = target->paths; gIter2 != NULL; gIter2 = gIter2->next) {
+			diskd_path_t *path = gIter2->data;
+
+			g_string_append_printf(out, "  path %s status=%s last=%lldus\n", path->name,
+				(path->healthy)? "healthy" : "failed", (long long)path->last);
+			for (window = 0; window <= 1; window++) {
+				diskd_lat_summary(&path->lat, window, &sum);
+				g_string_append_printf(out,
+					"    %-5s %-10s count=%llu p50=%lldus p99=%lldus p999=%lldus max=%lldus\n",
+					"io", (window)? "window" : "cumulative",
+					(unsigned long long)sum.n, (long long)sum.p50, (long long)sum.p99,
+					(long long)sum.p999, (long long)sum.max);
+			}
+		}
+	}
+}
+
+/*
+ * The status lines from the status page (-G) at path: no syscall into
+ * diskd, it answers even while its main loop is busy. FALSE: path is not
+ * a status page.
+ */
+static gboolean
+diskd_query_page(const char *path, GString *out, int *rc)
+{
+	const diskd_shm_t *map;
+	diskd_shm_t *copy;
+	size_t size;
+	guint32 i;
+
+	map = diskd_shm_attach(path, &size);
+	if (map == NULL) {
+		return FALSE;
+	}
+	copy = malloc(size);
+	if (copy == NULL || !diskd_shm_snapshot(map, size, copy)) {
+		fprintf(stderr, "no consistent status in %s\n", path);
+		*rc = QUERY_NO_ANSWER;
+	} else if (copy->pid == 0) {
+		fprintf(stderr, "diskd of %s has stopped\n", path);
+		*rc = QUERY_NO_ANSWER;
+	} else {
+		for (i = 0; i < copy->ntargets; i++) {
+			const diskd_shm_target_t *t = &copy->target[i];
+
+			g_string_append_printf(out, "target attr_name=%s target=%s status=%s\n",
+				t->attr_name, t->name, (t->status[0])? t->status : "unknown");
+		}
+	}
+	free(copy);
+	diskd_shm_detach(map, size);
+	return TRUE;
+}
+
+/*
+ * Client mode (-Q), run before the log and the root check so that the
+ * monitor of the RA stays cheap. Prints the status lines of the daemon,
+ * read from its status page (-G) or asked on its stats socket (-S).
+ */
+static int
+diskd_query(const char *path)
+{
+	GString *out = g_string_sized_new(256);
+	char **lines;
+	int i, rc = 0;
+
+	if (diskd_query_page(path, out, &rc)) {
+		if (rc != 0) {
+			g_string_free(out, TRUE);
+			return rc;
+		}
+	} else if (!diskd_stats_query(path, "status", QUERY_TIMEOUT, out)) {
+		fprintf(stderr, "diskd on %s does not answer: %s\n", path, strerror(errno));
+		g_string_free(out, TRUE);
+		return QUERY_NO_ANSWER;
+	}
+	fputs(out->str, stdout);
+
+	lines = g_strsplit(out->str, "\n", 0);
+	for (i = 0; lines[i] != NULL; i++) {
+		const char *status = strstr(lines[i], " status=");
+
+		if (lines[i][0] == '\0') {
+			continue;
+		}
+		if (status == NULL
+		    || (strcmp(status, " status=normal") != 0
+			&& strcmp(status, " status=degraded") != 0)) {
+			rc = ERROR;
+		}
+	}
+	g_strfreev(lines);
+	g_string_free(out, TRUE);
+	return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+	int argerr = 0;
+	int flag;
+	char *pid_file = NULL;
+	gboolean daemonize = FALSE;
+	diskd_target_t *target;
+	GList *gIter;
+	GList *extra_targets = NULL;
+	gboolean watch_mounts = FALSE;
+
+#ifdef HAVE_GETOPT_H
+	int option_index = 0;
 	static struct option long_options[] = {
 		/* Top-level Options */
 		{"verbose", 0, 0, 'V'},
@@ -619,10 +3673,54 @@ main(int argc, char **argv)
 		{"oneshot", 0, 0, 'o'},			/* add option 2009.10.01 */
 		{"exec-thread", 0, 0, 'e'},		/* add option 2011.09.30 */
 		{"dampen", 1, 0, 'm'},
+		{"target", 1, 0, 'T'},
+		{"io-engine", 1, 0, 'E'},
+		{"keep-open", 0, 0, 'k'},
+		{"stats-socket", 1, 0, 'S'},
+		{"slow-threshold", 1, 0, 'L'},
+		{"heartbeat", 1, 0, 'H'},
+		{"random-offset", 0, 0, 'R'},
+		{"probe-size", 1, 0, 'z'},
+		{"bypass-cache", 0, 0, 'F'},
+		{"multipath", 0, 0, 'M'},
+		{"min-interval", 1, 0, 'A'},
+		{"max-interval", 1, 0, 'X'},
+		{"passive", 0, 0, 'P'},
+		{"kernel-events", 0, 0, 'K'},
+		{"verify-write", 0, 0, 'W'},
+		{"status-file", 1, 0, 'G'},
+		{"slow-clear", 1, 0, 'l'},
+		{"query", 1, 0, 'Q'},
+		{"phase", 1, 0, 'O'},
+		{"jitter", 1, 0, 'j'},
+		{"throughput", 1, 0, 'b'},
+		{"metrics-file", 1, 0, 'x'},
+		{"flight-recorder", 1, 0, 'f'},
+		{"health-log", 1, 0, 'C'},
+		{"health-interval", 1, 0, 'c'},
+		{"ready-fd", 1, 0, 'y'},
 
 		{0, 0, 0, 0}
 	};
 #endif
+	/* -Q in any form, without the option values which happen to read "-Q" */
+	opterr = 0;
+	while (1) {
+#ifdef HAVE_GETOPT_H
+		flag = getopt_long(argc, argv, OPTARGS,
+				   long_options, &option_index);
+#else
+		flag = getopt(argc, argv, OPTARGS);
+#endif
+		if (flag == -1)
+			break;
+		if (flag == 'Q') {
+			return diskd_query(optarg);
+		}
+	}
+	opterr = 1;
+	optind = 1;
+
 	pid_file = strdup(PID_FILE);
 	crm_system_name = strdup(basename(argv[0]));
 
@@ -695,8 +3793,6 @@ main(int argc, char **argv)
 				break;
 			case 'd':   /* add option 2009.4.17 */
 				wdir = strdup(optarg);
-				wfile = calloc(1, PATH_MAX);
-				g_snprintf(wfile, PATH_MAX, "%s/%s", optarg, WRITE_FILE);
 				break;
 			case 'o':   /* add option 2009.10.01 */
 				oneshot_flag =1;
@@ -710,6 +3806,120 @@ main(int argc, char **argv)
 				else
 					attr_dampen = strdup(optarg);
 				break;
+			case 'R':
+				random_offset_flag = 1;
+				break;
+			case 'z':
+				probe_size = crm_parse_int(optarg, "-1");
+				if ((probe_size <= 0) || (probe_size > MAX_PROBE_SIZE))
+					++argerr;
+				break;
+			case 'F':
+				bypass_cache_flag = 1;
+				break;
+			case 'M':
+				multipath_flag = 1;
+				break;
+			case 'P':
+				passive_flag = 1;
+				break;
+			case 'K':
+				kevent_flag = 1;
+				break;
+			case 'W':
+				verify_flag = 1;
+				break;
+			case 'Q':
+				/* handled before the log and the root check */
+				break;
+			case 'G':
+				status_file = optarg;
+				break;
+			case 'A':
+				min_interval = crm_parse_int(optarg, "-1");
+				if ((min_interval < MIN_ADAPT_INTERVAL) || (min_interval > MAX_INTERVAL * 1000))
+					++argerr;
+				break;
+			case 'X':
+				max_interval = crm_parse_int(optarg, "-1");
+				if ((max_interval < MIN_INTERVAL) || (max_interval > MAX_INTERVAL))
+					++argerr;
+				break;
+			case 'O':
+				if (strcmp(optarg, "auto") == 0) {
+					phase_count = 0;
+				} else if (strcmp(optarg, "none") == 0) {
+					phase_count = -1;
+				} else if (sscanf(optarg, "%d/%d", &phase_slot, &phase_count) != 2
+					   || phase_slot < 0 || phase_count <= 0) {
+					++argerr;
+				}
+				break;
+			case 'x':
+				metrics_file = strdup(optarg);
+				break;
+			case 'f':
+				free(recorder_file);
+				recorder_file = strdup(optarg);
+				break;
+			case 'b':
+				throughput_flag = 1;
+				if (diskd_tp_parse(optarg) == FALSE)
+					++argerr;
+				break;
+			case 'C':
+				health_flag = 1;
+				if (diskd_health_backend(optarg) == FALSE)
+					++argerr;
+				break;
+			case 'c':
+				health_interval = crm_parse_int(optarg, "-1");
+				if ((health_interval < MIN_HEALTH_INTERVAL) || (health_interval > MAX_HEALTH_INTERVAL))
+					++argerr;
+				break;
+			case 'y':
+				ready_fd = crm_parse_int(optarg, "-1");
+				if (ready_fd < 0 || fcntl(ready_fd, F_SETFD, FD_CLOEXEC) < 0)
+					++argerr;
+				break;
+			case 'j':
+				jitter = crm_parse_int(optarg, "-1");
+				if ((jitter < 0) || (jitter > MAX_INTERVAL * 1000))
+					++argerr;
+				break;
+			case 'H':
+				heartbeat = crm_parse_int(optarg, "-1");
+				if ((heartbeat < MIN_HEARTBEAT) || (heartbeat > MAX_HEARTBEAT))
+					++argerr;
+				break;
+			case 'L':
+				slow_threshold = crm_parse_int(optarg, "-1");
+				if ((slow_threshold < MIN_SLOW_THRESHOLD) || (slow_threshold > MAX_SLOW_THRESHOLD))
+					++argerr;
+				break;
+			case 'l':
+				slow_clear = crm_parse_int(optarg, "-1");
+				if ((slow_clear < MIN_SLOW_THRESHOLD) || (slow_clear > MAX_SLOW_THRESHOLD))
+					++argerr;
+				break;
+			case 'S':
+				stats_socket = strdup(optarg);
+				break;
+			case 'k':
+				keep_open_flag = 1;
+				break;
+			case 'E':
+				io_engine = diskd_io_engine_parse(optarg);
+				if (io_engine < 0)
+					++argerr;
+				break;
+			case 'T':
+				target = diskd_target_parse(optarg);
+				if (target == NULL)
+					++argerr;
+				else
+					extra_targets = g_list_append(extra_targets, target);
+				break;
 			case '?':
 				usage(crm_system_name, 1);
 				break;
@@ -732,92 +3942,459 @@ main(int argc, char **argv)
 		printf("\n");
 		argerr ++;
 	}
-	if ((argerr) || (optflag >= 2) || (device == NULL && wflag == FALSE)) {  /* add optflag 2008.10.24 */
-		/* "-N" + "-w" pattern and not "-N" + not "-w"*/
+	if ((argerr) || (optflag >= 2)
+	    || (device == NULL && wflag == FALSE && extra_targets == NULL)) {  /* add optflag 2008.10.24 */
+		/* "-N" + "-w" pattern and not "-N" + not "-w" + not "-T" */
 		usage(crm_system_name, 1);
 	}
-	if ((device != NULL) && (wfile != NULL)) {
+	if ((device != NULL) && (wdir != NULL)) {
 		/* "-N" + "-d" pattern */
 		crm_warn("\"d\" option was ignored, because N option was specified.");
 	}
 
+	/* the target given by -N / -w comes first */
+	if (device != NULL) {
+		target = diskd_target_new(diskd_attr);
+		target->device = strdup(device);
+		targets = g_list_append(targets, target);
+	} else if (wflag) {
+		target = diskd_target_new(diskd_attr);
+		diskd_target_set_wdir(target, (wdir != NULL)? wdir : WRITE_DIR);
+		targets = g_list_append(targets, target);
+	}
+	targets = g_list_concat(targets, extra_targets);
+	if (diskd_target_resolve() == FALSE) {
+		usage(crm_system_name, 1);
+	}
+	if (multipath_flag) {
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			target = gIter->data;
+			if (target->wflag == FALSE) {
+				target->paths_attr = g_strdup_printf("%s-paths", target->attr_name);
+			}
+		}
+	}
+	if (health_flag) {
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			target = gIter->data;
+			target->health_attr = g_strdup_printf("%s-health", target->attr_name);
+		}
+	}
+
+	/*
+	 * Each target has its own aligned buffer (read: probe_size, write:
+	 * WRITE_DATA), its checks may run in parallel. Its content is never used.
+	 */
+	pagesize = getpagesize();
+	if (probe_size == 0) {
+		probe_size = pagesize;
+	} else if (probe_size % pagesize != 0) {
+		crm_err("probe-size %d is not a multiple of the page size %d", probe_size, pagesize);
+		usage(crm_system_name, 1);
+	}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		target = gIter->data;
+		if (posix_memalign(&target->iobuf, pagesize, MAX(probe_size, pagesize)) != 0) {
+			crm_err("Could not allocate memory");
+			if (oneshot_flag == 0) {
+				for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+					check_status(gIter->data, ERROR);
+				}
+			}
+			crm_exit(1);
+		}
+	}
+
+	/* a verified write has its own pages, checks may overlap */
+	for (gIter = targets; verify_flag && gIter != NULL; gIter = gIter->next) {
+		target = gIter->data;
+		if (target->wflag && posix_memalign(&target->vblock, pagesize, 2 * pagesize) != 0) {
+			crm_err("Could not allocate memory");
+			crm_exit(1);
+		}
+	}
+
 	if (oneshot_flag) {
 		int rc = 0;
 
 		free(pid_file);
 		rc = oneshot();
+		g_list_free_full(targets, diskd_target_free);
 		crm_exit(rc);
 	}
 
 	crm_make_daemon(crm_system_name, daemonize, pid_file);
-	diskd_thread_timer_init();
 
-	if ( wflag ) {	/* writer */
-		if (wfile == NULL) {
-			wdir = strdup(WRITE_DIR);
-			wfile = calloc(1, PATH_MAX);
-			g_snprintf(wfile, PATH_MAX, "%s/%s", WRITE_DIR, WRITE_FILE);
+	if (recorder_file == NULL) {
+		recorder_file = g_strdup_printf("%s.flight", pid_file);
+	} else if (strcmp(recorder_file, "none") == 0) {
+		free(recorder_file);
+		recorder_file = NULL;
+	}
+	if (recorder_file != NULL) {
+		recorder_trigger = mainloop_add_trigger(G_PRIORITY_LOW, diskd_recorder_flush, NULL);
+		mainloop_add_signal(SIGUSR1, diskd_recorder_signal);
+	}
+
+	if (stats_socket != NULL) {
+		diskd_stats_listen(stats_socket, diskd_stats_report);
+	}
+
+	if (status_file != NULL && diskd_shm_create(status_file, g_list_length(targets))) {
+		int i = 0;
+
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			target = gIter->data;
+			target->shm_index = i++;
+			g_strlcpy(target->shm.attr_name, target->attr_name, sizeof(target->shm.attr_name));
+			g_strlcpy(target->shm.name, target_name(target), sizeof(target->shm.name));
+			diskd_shm_update(target->shm_index, &target->shm);
 		}
-		buf = (void *)malloc(WRITE_DATA);
-		if (buf == NULL) {
-			crm_err("Could not allocate memory");
-			check_status(ERROR);
-			crm_exit(1);
+	} else {
+		status_file = NULL;
+	}
+
+	attrd_trigger = mainloop_add_trigger(G_PRIORITY_HIGH, diskd_attrd_flush, NULL);
+	if (heartbeat > 0) {
+		heartbeat_id = g_timeout_add(heartbeat * 1000, diskd_attrd_heartbeat, NULL);
+	}
+
+	diskd_io_init(io_engine);
+	diskd_watchdog_init();
+	diskd_target_phases();
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		struct stat st;
+
+		target = gIter->data;
+
+		crm_info("Monitoring %s (attr_name=%s, interval=%ds)",
+			target_name(target), target->attr_name, target->interval);
+		if (diskd_io_engine() != DISKD_IO_SYNC) {
+			target->check_fn = diskcheck_async;
+		} else {
+			target->check_fn = diskcheck_sync;
 		}
-		diskcheck_wt(NULL);
-		timer_id = g_timeout_add(interval*1000, diskcheck_wt, NULL);
-	} else {	/* reader */
-		pagesize = getpagesize();
-		ptr = (void *)malloc(2 * pagesize);
-		if (ptr == NULL) {
-			crm_err("Could not allocate memory");
-			check_status(ERROR);
-			crm_exit(1);
+		if (target->wflag) {
+			if (stat(target->wdir, &st) == 0) {
+				target->wdir_dev = st.st_dev;
+			}
+			watch_mounts = TRUE;
+		}
+		diskd_target_run(target);
+		diskd_target_schedule(target);
+	}
+
+	if (kevent_flag) {
+		diskd_kevent_start(diskd_kevent);
+	}
+	if (watch_mounts) {
+		diskd_mount_start(diskd_mount_changed);
+	}
+	if (metrics_file != NULL) {
+		diskd_metrics_write(NULL);
+		metrics_id = g_timeout_add_seconds(METRICS_FILE_INTERVAL, diskd_metrics_write, NULL);
+	}
+	if (health_flag) {
+		diskd_health_tick(NULL);
+		health_id = g_timeout_add_seconds(health_interval, diskd_health_tick, NULL);
+	}
+	if (throughput_flag && diskd_io_engine() == DISKD_IO_SYNC) {
+		crm_warn("the throughput probe needs an asynchronous I/O engine, disabled");
+	} else if (throughput_flag) {
+		for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+			diskd_tp_start(gIter->data);
 		}
-		buf = (void *)(((u_long)ptr + pagesize) & ~(pagesize-1));
-		diskcheck(NULL);
-		timer_id = g_timeout_add(interval*1000, diskcheck, NULL);
 	}
 
 	crm_info("Starting %s", crm_system_name);
 	mainloop = g_main_new(FALSE);
 	g_main_run(mainloop);
 
-	free(ptr);
-	free(pid_file);
-	if (wfile != NULL) {
-		free(wfile);
-	}
+	diskd_attrd_disconnect();
+	diskd_stats_close();
+	diskd_shm_close();
+	diskd_kevent_stop();
+	diskd_mount_stop();
 
-	diskd_thread_timer_end();
+	/* no I/O and no watchdog may still refer to a target or its buffers */
+	if (diskd_io_fini()) {
+		diskd_watchdog_end();
+		g_list_free_full(targets, diskd_target_free);
+		targets = NULL;
+	} else {
+		diskd_watchdog_end();
+	}
+	free(pid_file);
 
 	crm_info("Exiting %s", crm_system_name);
 	return 0;
 }
 
-void
-send_update(void)
+static int
+send_update(diskd_target_t *target, crm_ipc_t *ipc)
 {
 	int rc;
+	const char *value;
 
-#if ATTRD_UPDATE_BOTH
-	static gboolean boFirst = TRUE;
-#else
-	static gboolean boFirst = FALSE;
-#endif
+	diskd_lock();
+	value = target->value;
+	target->dirty = FALSE;
+	diskd_unlock();
 
-	if (boFirst) {
-	    rc = attrd_update_delegate(NULL, 'B', NULL, diskd_attr,
-		diskcheck_value, attr_section, attr_set, attr_dampen, NULL, attr_options);
+	if (target->first_update) {
+	    rc = attrd_update_delegate(ipc, 'B', NULL, target->attr_name,
+		value, attr_section, attr_set, attr_dampen, NULL, attr_options);
 	    if (rc == pcmk_ok) {
-			boFirst = FALSE;
+			target->first_update = FALSE;
 	    }
 	} else {
-	    rc = attrd_update_delegate(NULL, 'U', NULL, diskd_attr,
-		diskcheck_value, attr_section, attr_set, attr_dampen, NULL, attr_options);
+	    rc = attrd_update_delegate(ipc, 'U', NULL, target->attr_name,
+		value, attr_section, attr_set, attr_dampen, NULL, attr_options);
 	}
 
 	if (pcmk_ok != rc ) {
-		crm_err("Could not update %s=%s", diskd_attr, diskcheck_value);
+		crm_err("Could not update %s=%s", target->attr_name, value);
+		diskd_lock();
+		target->dirty = TRUE;
+		target->n_attrd_failures++;
+		diskd_unlock();
+	}
+	return rc;
+}
+
+static int
+send_paths_update(diskd_target_t *target, crm_ipc_t *ipc)
+{
+	int rc;
+	char value[sizeof(target->paths_value)];
+
+	diskd_lock();
+	strcpy(value, target->paths_value);
+	target->paths_dirty = FALSE;
+	diskd_unlock();
+
+	rc = attrd_update_delegate(ipc, (target->paths_first_update)? 'B' : 'U', NULL,
+		target->paths_attr, value, attr_section, attr_set, attr_dampen, NULL, attr_options);
+	if (rc == pcmk_ok) {
+		target->paths_first_update = FALSE;
+	} else {
+		crm_err("Could not update %s=%s", target->paths_attr, value);
+		diskd_lock();
+		target->paths_dirty = TRUE;
+		target->n_attrd_failures++;
+		diskd_unlock();
+	}
+	return rc;
+}
+
+static int
+send_health_update(diskd_target_t *target, crm_ipc_t *ipc)
+{
+	int rc;
+	char value[sizeof(target->health_value)];
+
+	diskd_lock();
+	strcpy(value, target->health_value);
+	target->health_dirty = FALSE;
+	diskd_unlock();
+
+	rc = attrd_update_delegate(ipc, (target->health_first_update)? 'B' : 'U', NULL,
+		target->health_attr, value, attr_section, attr_set, attr_dampen, NULL, attr_options);
+	if (rc == pcmk_ok) {
+		target->health_first_update = FALSE;
+	} else {
+		crm_err("Could not update %s=%s", target->health_attr, value);
+		diskd_lock();
+		target->health_dirty = TRUE;
+		target->n_attrd_failures++;
+		diskd_unlock();
+	}
+	return rc;
+}
+
+static void
+diskd_attrd_disconnect(void)
+{
+	if (attrd_ipc != NULL) {
+		crm_ipc_close(attrd_ipc);
+		crm_ipc_destroy(attrd_ipc);
+		attrd_ipc = NULL;
+	}
+}
+
+static crm_ipc_t *
+diskd_attrd_connect(void)
+{
+	if (attrd_ipc != NULL && crm_ipc_connected(attrd_ipc)) {
+		return attrd_ipc;
+	}
+	diskd_attrd_disconnect();
+
+	attrd_ipc = crm_ipc_new(T_ATTRD, 0);
+	if (attrd_ipc != NULL && crm_ipc_connect(attrd_ipc) == FALSE) {
+		crm_ipc_destroy(attrd_ipc);
+		attrd_ipc = NULL;
+	}
+	if (attrd_ipc == NULL) {
+		crm_info("Could not connect to attrd, using a temporary connection");
+	}
+	return attrd_ipc;
+}
+
+static gboolean
+diskd_attrd_retry(gpointer data)
+{
+	attrd_retry_id = 0;
+	mainloop_set_trigger(attrd_trigger);
+	return FALSE;
+}
+
+/* Send a state to the service manager (sd_notify protocol), if any */
+static void
+diskd_notify(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr;
+	socklen_t len;
+	int fd;
+
+	if (path == NULL || (path[0] != '/' && path[0] != '@')
+	    || strlen(path) >= sizeof(addr.sun_path)) {
+		return;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (path[0] == '@') {
+		/* abstract name space */
+		addr.sun_path[0] = '\0';
+	}
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		crm_perror(LOG_WARNING, "notify socket");
+		return;
+	}
+	if (sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, len) < 0) {
+		crm_perror(LOG_WARNING, "notify %s", path);
+	}
+	close(fd);
+}
+
+/*
+ * Readiness: once the first status of every target is in attrd, a line
+ * "READY=1 <attr_name>=<status>..." is written to the -y descriptor,
+ * which is then closed, and READY=1 is sent to $NOTIFY_SOCKET. The RA
+ * start returns on it instead of polling.
+ */
+static void
+diskd_notify_ready(void)
+{
+	GString *status;
+	GList *gIter;
+	char *state;
+
+	if (ready_sent) {
+		return;
+	}
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (target->value == NULL || target->first_update) {
+			return;
+		}
+	}
+	ready_sent = TRUE;
+
+	status = g_string_new("");
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		g_string_append_printf(status, "%s%s=%s", (gIter == targets)? "" : " ",
+			target->attr_name, target->value);
+	}
+	crm_info("ready: %s", status->str);
+
+	if (ready_fd >= 0) {
+		/* the reader may be gone (the start has timed out) */
+		void (*sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+		state = g_strdup_printf("READY=1 %s\n", status->str);
+		if (write(ready_fd, state, strlen(state)) < 0) {
+			crm_perror(LOG_WARNING, "ready-fd %d", ready_fd);
+		}
+		signal(SIGPIPE, sigpipe);
+		g_free(state);
+		close(ready_fd);
+		ready_fd = -1;
+	}
+	state = g_strdup_printf("READY=1\nSTATUS=%s\nMAINPID=%d", status->str, (int)getpid());
+	diskd_notify(state);
+	g_free(state);
+	g_string_free(status, TRUE);
+}
+
+/* Send all changed values over the kept connection */
+static int
+diskd_attrd_flush(gpointer data)
+{
+	GList *gIter;
+	crm_ipc_t *ipc;
+	int failed = 0;
+
+	if (attrd_retry_id != 0) {
+		/* waiting for the backoff, diskd_attrd_retry() sends them */
+		return TRUE;
+	}
+
+	ipc = diskd_attrd_connect();
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (target->dirty && target->value != NULL
+		    && send_update(target, ipc) != pcmk_ok) {
+			failed++;
+		}
+		if (target->paths_dirty && send_paths_update(target, ipc) != pcmk_ok) {
+			failed++;
+		}
+		if (target->health_dirty && send_health_update(target, ipc) != pcmk_ok) {
+			failed++;
+		}
+	}
+
+	if (failed) {
+		diskd_attrd_disconnect();
+		attrd_backoff = (attrd_backoff == 0)? 1 : MIN(attrd_backoff * 2, MAX_ATTRD_BACKOFF);
+		crm_warn("%d attribute update(s) failed. retry in %ds", failed, attrd_backoff);
+		attrd_retry_id = g_timeout_add(attrd_backoff * 1000, diskd_attrd_retry, NULL);
+	} else {
+		attrd_backoff = 0;
+		diskd_notify_ready();
+	}
+	return TRUE;
+}
+
+static gboolean
+diskd_attrd_heartbeat(gpointer data)
+{
+	GList *gIter;
+
+	for (gIter = targets; gIter != NULL; gIter = gIter->next) {
+		diskd_target_t *target = gIter->data;
+
+		if (target->value != NULL) {
+			target->dirty = TRUE;
+		}
+		if (target->paths_value[0] != '\0') {
+			target->paths_dirty = TRUE;
+		}
+		if (target->health_value[0] != '\0') {
+			target->health_dirty = TRUE;
+		}
 	}
+	mainloop_set_trigger(attrd_trigger);
+	return TRUE;
 }
@@ -0,0 +1,478 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   health logs (SMART, NVMe) of the disks.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_SCSI_SG_H
+#  include <scsi/sg.h>
+#endif
+#ifdef HAVE_LINUX_NVME_IOCTL_H
+#  include <linux/nvme_ioctl.h>
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <crm/crm.h>
+
+#include "diskd_health.h"
+#include "diskd_mpath.h"
+
+#define SYS_BLOCK		"/sys/block"
+#define HEALTH_TIMEOUT		10000	/* [ms] of a log command */
+#define HEALTH_LOG_SIZE		512
+#define HEALTH_DRIVER_SENSE	0x08	/* driver_status: sense data is valid */
+
+/* ATA SMART attributes counted as defects */
+#define ATA_REALLOCATED		5
+#define ATA_TEMPERATURE		194
+#define ATA_PENDING		197
+#define ATA_UNCORRECTABLE	198
+
+typedef gboolean (*health_read_fn)(const char *name, int fd, diskd_health_t *health);
+
+typedef struct health_backend_s {
+	const char *name;
+	health_read_fn read;
+} health_backend_t;
+
+typedef struct health_cache_s {
+	char *name;
+	const health_backend_t *backend;	/* which has answered, NULL: not yet */
+	gint64 time;				/* monotonic [us] of the result */
+	diskd_health_t health;
+} health_cache_t;
+
+static gboolean health_nvme(const char *name, int fd, diskd_health_t *health);
+static gboolean health_ata(const char *name, int fd, diskd_health_t *health);
+static gboolean health_scsi(const char *name, int fd, diskd_health_t *health);
+static gboolean health_mock(const char *name, int fd, diskd_health_t *health);
+
+static const health_backend_t backends[] = {
+	{ "nvme", health_nvme },
+	{ "ata", health_ata },
+	{ "scsi", health_scsi },
+	{ "mock", health_mock },
+};
+
+static const health_backend_t *selected = NULL;	/* NULL: auto */
+static char *mock_dir = NULL;
+static GList *cache = NULL;
+
+gboolean
+diskd_health_backend(const char *spec)
+{
+	size_t i;
+
+	if (strcmp(spec, "auto") == 0) {
+		selected = NULL;
+		return TRUE;
+	}
+	if (strncmp(spec, "mock:", 5) == 0 && spec[5] != '\0') {
+		free(mock_dir);
+		mock_dir = strdup(spec + 5);
+		selected = &backends[G_N_ELEMENTS(backends) - 1];
+		return TRUE;
+	}
+	for (i = 0; i < G_N_ELEMENTS(backends) - 1; i++) {
+		if (strcmp(spec, backends[i].name) == 0) {
+			selected = &backends[i];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+gboolean
+diskd_health_is_disk(const char *name)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (selected != NULL && selected->read == health_mock) {
+		return TRUE;
+	}
+	/* only whole disks are in /sys/block, and only real ones have a device */
+	g_snprintf(path, sizeof(path), "%s/%s/device", SYS_BLOCK, name);
+	return (stat(path, &st) == 0);
+}
+
+static void
+health_set_failing(diskd_health_t *health, const char *reason)
+{
+	health->state = DISKD_HEALTH_FAILING;
+	if (health->reason[0] == '\0') {
+		g_strlcpy(health->reason, reason, sizeof(health->reason));
+	}
+}
+
+/*
+ * NVMe: SMART / Health Information log page (02h) of the controller.
+ * Any critical warning but the temperature one, or the rated endurance
+ * used up, predicts a failure.
+ */
+static gboolean
+health_nvme(const char *name, int fd, diskd_health_t *health)
+{
+#ifdef HAVE_LINUX_NVME_IOCTL_H
+	struct nvme_admin_cmd cmd;
+	unsigned char log[HEALTH_LOG_SIZE];
+	guint64 media_errors = 0;
+	int i;
+
+	if (strncmp(name, "nvme", 4) != 0) {
+		return FALSE;
+	}
+	memset(&cmd, 0, sizeof(cmd));
+	memset(log, 0, sizeof(log));
+	cmd.opcode = 0x02;			/* Get Log Page */
+	cmd.nsid = 0xffffffff;			/* the controller */
+	cmd.addr = (unsigned long)log;
+	cmd.data_len = sizeof(log);
+	cmd.cdw10 = ((sizeof(log) / 4 - 1) << 16) | 0x02;
+	cmd.timeout_ms = HEALTH_TIMEOUT;
+	if (ioctl(fd, NVME_IOCTL_ADMIN_CMD, &cmd) != 0) {
+		return FALSE;
+	}
+
+	health->state = DISKD_HEALTH_OK;
+	health->temperature = (log[1] | (log[2] << 8)) - 273;
+	health->wear = log[5];
+	for (i = 7; i >= 0; i--) {
+		media_errors = (media_errors << 8) | log[160 + i];
+	}
+	health->defects = (gint64)media_errors;
+
+	if (log[0] & 0x01) {
+		health_set_failing(health, "available spare below threshold");
+	}
+	if (log[0] & 0x04) {
+		health_set_failing(health, "reliability degraded");
+	}
+	if (log[0] & 0x08) {
+		health_set_failing(health, "read-only");
+	}
+	if (log[0] & 0x10) {
+		health_set_failing(health, "volatile memory backup failed");
+	}
+	if (health->wear >= 100) {
+		health_set_failing(health, "endurance used up");
+	}
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+#ifdef HAVE_SCSI_SG_H
+/* Returns the length of the response, -1: the command failed */
+static int
+health_sg(int fd, unsigned char *cdb, int cdb_len, unsigned char *sense, int sense_len,
+	  unsigned char *data, int data_len)
+{
+	sg_io_hdr_t io_hdr;
+
+	memset(&io_hdr, 0, sizeof(io_hdr));
+	io_hdr.interface_id = 'S';
+	io_hdr.cmd_len = cdb_len;
+	io_hdr.cmdp = cdb;
+	io_hdr.mx_sb_len = sense_len;
+	io_hdr.sbp = sense;
+	io_hdr.dxfer_direction = (data_len > 0)? SG_DXFER_FROM_DEV : SG_DXFER_NONE;
+	io_hdr.dxfer_len = data_len;
+	io_hdr.dxferp = data;
+	io_hdr.timeout = HEALTH_TIMEOUT;
+
+	if (ioctl(fd, SG_IO, &io_hdr) < 0) {
+		return -1;
+	}
+	/* SMART RETURN STATUS answers with CHECK CONDITION on purpose (CK_COND) */
+	if (io_hdr.host_status != 0 || (io_hdr.driver_status & ~HEALTH_DRIVER_SENSE) != 0) {
+		return -1;
+	}
+	return data_len - io_hdr.resid;
+}
+
+static void
+health_ata_cdb(unsigned char *cdb, unsigned char feature, gboolean data_in)
+{
+	memset(cdb, 0, 16);
+	cdb[0] = 0x85;				/* ATA PASS-THROUGH(16) */
+	if (data_in) {
+		cdb[1] = 4 << 1;		/* PIO data-in */
+		cdb[2] = 0x0e;			/* from the device, in blocks, count in sector count */
+		cdb[6] = 1;
+	} else {
+		cdb[1] = 3 << 1;		/* non-data */
+		cdb[2] = 0x20;			/* CK_COND: return the registers */
+	}
+	cdb[4] = feature;
+	cdb[10] = 0x4f;				/* SMART signature */
+	cdb[12] = 0xc2;
+	cdb[14] = 0xb0;				/* SMART */
+}
+#endif
+
+/*
+ * ATA through SAT: SMART RETURN STATUS tells whether an attribute has
+ * crossed its threshold. Pending and uncorrectable sectors also predict
+ * a failure, they are data already unreadable.
+ */
+static gboolean
+health_ata(const char *name, int fd, diskd_health_t *health)
+{
+#ifdef HAVE_SCSI_SG_H
+	unsigned char cdb[16];
+	unsigned char sense[32];
+	unsigned char data[HEALTH_LOG_SIZE];
+	unsigned char *desc = sense + 8;
+	gint64 pending = 0;
+	int i;
+
+	health_ata_cdb(cdb, 0xda, FALSE);	/* SMART RETURN STATUS */
+	memset(sense, 0, sizeof(sense));
+	if (health_sg(fd, cdb, sizeof(cdb), sense, sizeof(sense), NULL, 0) < 0) {
+		return FALSE;
+	}
+	/* descriptor sense with the ATA Status Return descriptor */
+	if ((sense[0] & 0x7f) != 0x72 || desc[0] != 0x09) {
+		return FALSE;
+	}
+	if (desc[9] == 0x4f && desc[11] == 0xc2) {
+		health->state = DISKD_HEALTH_OK;
+	} else if (desc[9] == 0xf4 && desc[11] == 0x2c) {
+		health_set_failing(health, "SMART threshold exceeded");
+	} else {
+		return FALSE;
+	}
+
+	health_ata_cdb(cdb, 0xd0, TRUE);	/* SMART READ DATA */
+	memset(data, 0, sizeof(data));
+	if (health_sg(fd, cdb, sizeof(cdb), sense, sizeof(sense), data, sizeof(data))
+	    != sizeof(data)) {
+		return TRUE;
+	}
+	health->defects = 0;
+	for (i = 2; i + 12 <= 2 + 30 * 12; i += 12) {
+		/* id, flags(2), value, worst, raw(6), reserved */
+		guint32 raw = data[i + 5] | (data[i + 6] << 8) | (data[i + 7] << 16)
+			| ((guint32)data[i + 8] << 24);
+
+		switch (data[i]) {
+			case ATA_REALLOCATED:
+				health->defects += raw;
+				break;
+			case ATA_PENDING:
+			case ATA_UNCORRECTABLE:
+				health->defects += raw;
+				pending += raw;
+				break;
+			case ATA_TEMPERATURE:
+				health->temperature = data[i + 5];
+				break;
+		}
+	}
+	if (pending > 0) {
+		health_set_failing(health, "pending or uncorrectable sectors");
+	}
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * SCSI: the Informational Exceptions log page (2Fh) holds the additional
+ * sense code of the last failure prediction, 0 when there is none.
+ */
+static gboolean
+health_scsi(const char *name, int fd, diskd_health_t *health)
+{
+#ifdef HAVE_SCSI_SG_H
+	unsigned char cdb[10];
+	unsigned char sense[32];
+	unsigned char data[64];
+	int len;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = 0x4d;				/* LOG SENSE */
+	cdb[2] = 0x40 | 0x2f;			/* cumulative values, Informational Exceptions */
+	cdb[8] = sizeof(data);
+	memset(data, 0, sizeof(data));
+	len = health_sg(fd, cdb, sizeof(cdb), sense, sizeof(sense), data, sizeof(data));
+	if (len < 11 || (data[0] & 0x3f) != 0x2f) {
+		return FALSE;
+	}
+
+	health->state = DISKD_HEALTH_OK;
+	if (data[10] != 0xff) {
+		health->temperature = data[10];
+	}
+	if (data[8] != 0) {
+		char reason[sizeof(health->reason)];
+
+		g_snprintf(reason, sizeof(reason), "failure prediction (asc=0x%02x ascq=0x%02x)",
+			data[8], data[9]);
+		health_set_failing(health, reason);
+	}
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+/* Mock: key=value pairs in <dir>/<name>, to test the cluster reaction */
+static gboolean
+health_mock(const char *name, int fd, diskd_health_t *health)
+{
+	char path[PATH_MAX];
+	char line[256];
+	char **words;
+	FILE *fp;
+	int i;
+
+	g_snprintf(path, sizeof(path), "%s/%s", mock_dir, name);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return FALSE;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL) {
+		fclose(fp);
+		return FALSE;
+	}
+	fclose(fp);
+	g_strstrip(line);
+
+	health->state = DISKD_HEALTH_OK;
+	words = g_strsplit(line, " ", 0);
+	for (i = 0; words[i] != NULL; i++) {
+		const char *value = strchr(words[i], '=');
+
+		if (value == NULL) {
+			continue;
+		}
+		value++;
+		if (strncmp(words[i], "state=", 6) == 0) {
+			health->state = (strcmp(value, "failing") == 0)?
+				DISKD_HEALTH_FAILING : DISKD_HEALTH_OK;
+		} else if (strncmp(words[i], "reason=", 7) == 0) {
+			g_strlcpy(health->reason, value, sizeof(health->reason));
+		} else if (strncmp(words[i], "temperature=", 12) == 0) {
+			health->temperature = atoi(value);
+		} else if (strncmp(words[i], "wear=", 5) == 0) {
+			health->wear = atoi(value);
+		} else if (strncmp(words[i], "defects=", 8) == 0) {
+			health->defects = g_ascii_strtoll(value, NULL, 10);
+		}
+	}
+	g_strfreev(words);
+	if (health->state == DISKD_HEALTH_FAILING && health->reason[0] == '\0') {
+		g_strlcpy(health->reason, "mock", sizeof(health->reason));
+	}
+	return TRUE;
+}
+
+static gboolean
+health_try(const health_backend_t *backend, const char *name, int fd, diskd_health_t *health)
+{
+	memset(health, 0, sizeof(*health));
+	health->temperature = -1;
+	health->wear = -1;
+	health->defects = -1;
+	if (backend->read(name, fd, health) == FALSE) {
+		health->state = DISKD_HEALTH_UNKNOWN;
+		return FALSE;
+	}
+	health->backend = backend->name;
+	return TRUE;
+}
+
+void
+diskd_health_read(const char *name, int max_age, diskd_health_t *health)
+{
+	gint64 now = g_get_monotonic_time();
+	health_cache_t *entry = NULL;
+	GList *gIter;
+	char *devnode;
+	size_t i;
+	int fd = -1;
+
+	for (gIter = cache; gIter != NULL; gIter = gIter->next) {
+		if (strcmp(((health_cache_t *)gIter->data)->name, name) == 0) {
+			entry = gIter->data;
+			break;
+		}
+	}
+	if (entry == NULL) {
+		entry = calloc(1, sizeof(health_cache_t));
+		if (entry == NULL) {
+			health->state = DISKD_HEALTH_UNKNOWN;
+			return;
+		}
+		entry->name = strdup(name);
+		cache = g_list_append(cache, entry);
+	} else if (entry->time != 0 && now - entry->time < max_age * G_TIME_SPAN_SECOND) {
+		*health = entry->health;
+		return;
+	}
+
+	if (selected == NULL || selected->read != health_mock) {
+		devnode = diskd_mpath_devnode(name);
+		fd = open(devnode, O_RDONLY | O_NONBLOCK, 0);
+		if (fd < 0) {
+			crm_perror(LOG_WARNING, "health log of %s", devnode);
+		}
+		free(devnode);
+		if (fd < 0) {
+			health->state = DISKD_HEALTH_UNKNOWN;
+			return;
+		}
+	}
+
+	if (selected != NULL) {
+		health_try(selected, name, fd, &entry->health);
+	} else if (entry->backend != NULL) {
+		health_try(entry->backend, name, fd, &entry->health);
+	} else {
+		for (i = 0; i < G_N_ELEMENTS(backends) - 1; i++) {
+			if (health_try(&backends[i], name, fd, &entry->health)) {
+				entry->backend = &backends[i];
+				crm_info("health log of %s is read by the %s backend", name,
+					backends[i].name);
+				break;
+			}
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	entry->time = now;
+	*health = entry->health;
+}
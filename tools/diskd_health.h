@@ -0,0 +1,59 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   health logs (SMART, NVMe) of the disks.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_HEALTH_H
+#define DISKD_HEALTH_H
+
+#include <glib.h>
+
+#define DISKD_HEALTH_UNKNOWN	0	/* no backend could read the log */
+#define DISKD_HEALTH_OK		1
+#define DISKD_HEALTH_FAILING	2	/* the disk predicts its own failure */
+
+typedef struct diskd_health_s {
+	int state;
+	const char *backend;	/* which has read the log */
+	int temperature;	/* [C] -1: unknown */
+	int wear;		/* [%] of the rated endurance used, -1: unknown */
+	gint64 defects;		/* reallocated/pending sectors or media errors, -1: unknown */
+	char reason[64];	/* why the failure is predicted */
+} diskd_health_t;
+
+/*
+ * Select the backend: "auto" (nvme for NVMe disks, ata then scsi for the
+ * others), "nvme", "ata", "scsi" or "mock:<dir>". The mock backend reads
+ * <dir>/<name>, e.g. "state=failing reason=worn-out wear=100".
+ * FALSE: unknown backend.
+ */
+extern gboolean diskd_health_backend(const char *spec);
+
+/* TRUE when the kernel name is a physical disk (not a partition, dm, md, loop...) */
+extern gboolean diskd_health_is_disk(const char *name);
+
+/*
+ * Read the health log of a disk by its kernel name ("sdc", "nvme0n1").
+ * A result younger than max_age [s] is answered from the cache. May block
+ * for the command timeout; not thread-safe, call from one thread only.
+ */
+extern void diskd_health_read(const char *name, int max_age, diskd_health_t *health);
+
+#endif /* DISKD_HEALTH_H */
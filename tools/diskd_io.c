@@ -0,0 +1,1276 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   asynchronous disk check I/O engine.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+/*
+ * The disk check I/O is submitted to the kernel and its completion is
+ * reaped from the main loop through an eventfd, so a hung device never
+ * blocks the main loop.
+ *
+ *  io_uring : the read/write is linked to an IORING_OP_LINK_TIMEOUT, so
+ *             the kernel itself enforces the per-check deadline.
+ *  Linux AIO: fallback for kernels without io_uring. The deadline is a
+ *             main loop timer.
+ *  worker   : blocking I/O in a pool of helper processes, for kernels or
+ *             devices where neither of them works. A worker hung in the
+ *             kernel is abandoned instead of the daemon.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_DECL_IORING_OP_LINK_TIMEOUT
+#  include <linux/io_uring.h>
+#  define DISKD_USE_URING	1
+#endif
+#ifdef HAVE_LINUX_AIO_ABI_H
+#  include <linux/aio_abi.h>
+#  define DISKD_USE_AIO		1
+#endif
+
+#include <crm/crm.h>
+
+#include "diskd_io.h"
+
+#define IO_QUEUE_DEPTH		256	/* submission queue entries */
+#define IO_REAP_BATCH		32
+#define IO_FINI_WAIT		2	/* [s] for the kernel to give back the buffers */
+
+typedef struct diskd_io_req_s {
+	diskd_io_cb_t cb;
+	gpointer user_data;
+	struct iovec iov;
+	gboolean write;
+	int pending;		/* completions still owned by the kernel */
+	gboolean done;		/* callback already called */
+#ifdef DISKD_USE_URING
+	struct __kernel_timespec ts;
+#endif
+#ifdef DISKD_USE_AIO
+	struct iocb iocb;
+	guint timer_id;
+	struct aio_ring_s *ring;	/* context it was submitted to */
+	gboolean abandoned;	/* past its deadline, still owned by the kernel */
+#endif
+} diskd_io_req_t;
+
+static int io_engine = DISKD_IO_SYNC;
+static int io_efd = -1;
+static GIOChannel *io_channel = NULL;
+static guint io_watch_id = 0;
+static GList *io_kernel_reqs = NULL;	/* owned by io_uring or AIO, with their buffers */
+static gboolean io_closing = FALSE;	/* the owners of the requests are gone */
+
+static void
+diskd_io_complete(diskd_io_req_t *req, ssize_t result, int err)
+{
+	if (req->done) {
+		return;
+	}
+	req->done = TRUE;
+	if (io_closing == FALSE) {
+		req->cb(req->user_data, result, err);
+	}
+}
+
+/* the kernel has given back a request of io_uring or AIO */
+static void
+io_req_free(diskd_io_req_t *req)
+{
+	io_kernel_reqs = g_list_remove(io_kernel_reqs, req);
+	free(req);
+}
+
+#ifdef DISKD_USE_URING
+/* ---------------------------------------------------------------- io_uring */
+
+#define URING_TIMEOUT_TAG	((uint64_t)1)	/* tag of the linked timeout CQE */
+#define URING_ENTER_RETRY	3	/* io_uring_enter calls for one request */
+
+static int ring_fd = -1;
+static void *sq_ptr = NULL;
+static size_t sq_size = 0;
+static void *cq_ptr = NULL;
+static size_t cq_size = 0;
+static struct io_uring_sqe *sqes = NULL;
+static size_t sqes_size = 0;
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(unsigned to_submit)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int
+uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void
+uring_fini(void)
+{
+	if (sqes != NULL) {
+		munmap(sqes, sqes_size);
+		sqes = NULL;
+	}
+	if (cq_ptr != NULL && cq_ptr != sq_ptr) {
+		munmap(cq_ptr, cq_size);
+	}
+	cq_ptr = NULL;
+	if (sq_ptr != NULL) {
+		munmap(sq_ptr, sq_size);
+		sq_ptr = NULL;
+	}
+	if (ring_fd >= 0) {
+		close(ring_fd);
+		ring_fd = -1;
+	}
+}
+
+/*
+ * The kernel must know READV/WRITEV and LINK_TIMEOUT (Linux 5.5), and
+ * the probe itself (IORING_REGISTER_PROBE) needs Linux 5.6 or later.
+ */
+static gboolean
+uring_probe_ops(void)
+{
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	gboolean ok = FALSE;
+
+	if (probe == NULL) {
+		return FALSE;
+	}
+	if (uring_register(IORING_REGISTER_PROBE, probe, 256) == 0
+	    && probe->last_op >= IORING_OP_LINK_TIMEOUT
+	    && (probe->ops[IORING_OP_READV].flags & IO_URING_OP_SUPPORTED)
+	    && (probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED)
+	    && (probe->ops[IORING_OP_LINK_TIMEOUT].flags & IO_URING_OP_SUPPORTED)) {
+		ok = TRUE;
+	}
+	free(probe);
+	return ok;
+}
+
+static gboolean
+uring_init(void)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ring_fd = uring_setup(IO_QUEUE_DEPTH, &p);
+	if (ring_fd < 0) {
+		crm_info("io_uring is not available: %s", strerror(errno));
+		return FALSE;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_size = cq_size = MAX(sq_size, cq_size);
+	}
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		sq_ptr = NULL;
+		goto bail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			cq_ptr = NULL;
+			goto bail;
+		}
+	}
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		sqes = NULL;
+		goto bail;
+	}
+
+	sq_head = (unsigned *)((char *)sq_ptr + p.sq_off.head);
+	sq_tail = (unsigned *)((char *)sq_ptr + p.sq_off.tail);
+	sq_mask = (unsigned *)((char *)sq_ptr + p.sq_off.ring_mask);
+	sq_entries = (unsigned *)((char *)sq_ptr + p.sq_off.ring_entries);
+	sq_array = (unsigned *)((char *)sq_ptr + p.sq_off.array);
+	cq_head = (unsigned *)((char *)cq_ptr + p.cq_off.head);
+	cq_tail = (unsigned *)((char *)cq_ptr + p.cq_off.tail);
+	cq_mask = (unsigned *)((char *)cq_ptr + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)((char *)cq_ptr + p.cq_off.cqes);
+
+	if (uring_probe_ops() == FALSE) {
+		crm_info("io_uring does not support linked timeouts on this kernel");
+		uring_fini();
+		return FALSE;
+	}
+	if (uring_register(IORING_REGISTER_EVENTFD, &io_efd, 1) < 0) {
+		crm_perror(LOG_ERR, "io_uring eventfd registration");
+		uring_fini();
+		return FALSE;
+	}
+	return TRUE;
+
+bail:
+	crm_perror(LOG_ERR, "io_uring ring mapping");
+	uring_fini();
+	return FALSE;
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(unsigned *tail)
+{
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned idx;
+
+	if (*tail - head >= *sq_entries) {
+		return NULL;
+	}
+	idx = *tail & *sq_mask;
+	sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	(*tail)++;
+	return sqe;
+}
+
+static int
+uring_submit(int fd, gboolean write, off_t offset, int timeout, diskd_io_req_t *req)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *sq_tail;
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned submitted = 0;
+	int retry = 0;
+	int rc = 0;
+	int err = EAGAIN;
+
+	if (*sq_entries - (tail - head) < 2) {
+		return -EBUSY;
+	}
+
+	sqe = uring_get_sqe(&tail);
+	sqe->opcode = (write)? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)&req->iov;
+	sqe->len = 1;
+	sqe->off = offset;
+	sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = (uint64_t)(uintptr_t)req;
+
+	req->ts.tv_sec = timeout;
+	req->ts.tv_nsec = 0;
+	sqe = uring_get_sqe(&tail);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)&req->ts;
+	sqe->len = 1;
+	sqe->user_data = (uint64_t)(uintptr_t)req | URING_TIMEOUT_TAG;
+
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+	/* the kernel may consume fewer entries than asked, the rest stays in the ring */
+	while (submitted < 2 && retry++ < URING_ENTER_RETRY) {
+		rc = uring_enter(2 - submitted);
+		if (rc < 0) {
+			err = errno;
+			if (err != EINTR && err != EAGAIN && err != EBUSY) {
+				break;
+			}
+		} else {
+			submitted += rc;
+		}
+	}
+	if (submitted >= 2) {
+		req->pending = 2;
+		return 0;
+	}
+
+	/* take back the entries not consumed */
+	__atomic_store_n(sq_tail, tail - (2 - submitted), __ATOMIC_RELEASE);
+	if (submitted == 0) {
+		return -err;
+	}
+	/* the I/O is queued but not its timeout: it is bounded by the watchdog only */
+	crm_warn("io_uring: the timeout of a request could not be queued: %s", strerror(err));
+	req->pending = 1;
+	return 0;
+}
+
+static void
+uring_reap(void)
+{
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		diskd_io_req_t *req = (diskd_io_req_t *)(uintptr_t)(data & ~URING_TIMEOUT_TAG);
+
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+		if (req == NULL) {
+			/* an IORING_OP_ASYNC_CANCEL of uring_cancel_all() */
+		} else if (data & URING_TIMEOUT_TAG) {
+			/*
+			 * -ETIME   : the deadline passed, the I/O was cancelled
+			 * -EALREADY: the deadline passed, the I/O could not be cancelled
+			 */
+			if (res == -ETIME || res == -EALREADY) {
+				diskd_io_complete(req, -1, ETIMEDOUT);
+			}
+		} else if (res == -ECANCELED) {
+			diskd_io_complete(req, -1, ETIMEDOUT);
+		} else if (res < 0) {
+			diskd_io_complete(req, -1, -res);
+		} else {
+			diskd_io_complete(req, res, 0);
+		}
+
+		if (req != NULL && --req->pending == 0) {
+			io_req_free(req);
+		}
+		tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+/* ask the kernel to cancel every request, at shutdown */
+static void
+uring_cancel_all(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *sq_tail;
+	unsigned n = 0;
+	GList *gIter;
+
+	for (gIter = io_kernel_reqs; gIter != NULL; gIter = gIter->next) {
+		sqe = uring_get_sqe(&tail);
+		if (sqe == NULL) {
+			break;
+		}
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)gIter->data;
+		sqe->user_data = 0;
+		n++;
+	}
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+	if (n > 0 && uring_enter(n) < 0) {
+		crm_perror(LOG_WARNING, "io_uring: cancel of %u requests", n);
+	}
+}
+#endif /* DISKD_USE_URING */
+
+#ifdef DISKD_USE_AIO
+/* --------------------------------------------------------------- Linux AIO */
+
+/*
+ * A request past its deadline stays owned by the kernel until it
+ * completes, which a dead path without a SCSI timeout never does. Beyond
+ * AIO_ABANDONED_MAX of them the context is retired and a new one is used;
+ * a retired context is destroyed once all its requests have completed.
+ * With AIO_RETIRED_MAX retired contexts, new requests are refused.
+ */
+#define AIO_ABANDONED_MAX	16
+#define AIO_RETIRED_MAX		4
+
+typedef struct aio_ring_s {
+	aio_context_t ctx;
+	int inflight;		/* requests owned by the kernel */
+	int abandoned;		/* of which past their deadline */
+} aio_ring_t;
+
+static aio_ring_t *aio_cur = NULL;
+static GList *aio_retired = NULL;	/* list of aio_ring_t */
+
+static aio_ring_t *
+aio_ring_new(void)
+{
+	aio_ring_t *ring = calloc(1, sizeof(aio_ring_t));
+
+	if (ring == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (syscall(__NR_io_setup, IO_QUEUE_DEPTH, &ring->ctx) < 0) {
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+static gboolean
+aio_init(void)
+{
+	aio_cur = aio_ring_new();
+	if (aio_cur == NULL) {
+		crm_info("Linux AIO is not available: %s", strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+aio_fini(void)
+{
+	/* io_destroy would wait for the hung requests, the exit releases them */
+	if (aio_cur != NULL) {
+		if (aio_cur->inflight == 0) {
+			syscall(__NR_io_destroy, aio_cur->ctx);
+		}
+		free(aio_cur);
+		aio_cur = NULL;
+	}
+	g_list_free_full(aio_retired, free);
+	aio_retired = NULL;
+}
+
+static void
+aio_retire(void)
+{
+	aio_ring_t *ring;
+
+	if (g_list_length(aio_retired) >= AIO_RETIRED_MAX) {
+		return;
+	}
+	ring = aio_ring_new();
+	if (ring == NULL) {
+		crm_perror(LOG_WARNING, "new AIO context");
+		return;
+	}
+	crm_warn("%d I/O requests do not complete, the AIO context is replaced",
+		aio_cur->abandoned);
+	aio_retired = g_list_append(aio_retired, aio_cur);
+	aio_cur = ring;
+}
+
+/* the kernel has given back req, with the result res */
+static void
+aio_req_done(diskd_io_req_t *req, long res)
+{
+	aio_ring_t *ring = req->ring;
+
+	if (req->timer_id != 0) {
+		g_source_remove(req->timer_id);
+		req->timer_id = 0;
+	}
+	if (res < 0) {
+		diskd_io_complete(req, -1, (int)-res);
+	} else {
+		diskd_io_complete(req, res, 0);
+	}
+	ring->inflight--;
+	if (req->abandoned) {
+		ring->abandoned--;
+	}
+	io_req_free(req);
+}
+
+/* ask the kernel to cancel every request, at shutdown */
+static void
+aio_cancel_all(void)
+{
+	struct io_event ev;
+	GList *gIter, *next;
+
+	for (gIter = io_kernel_reqs; gIter != NULL; gIter = next) {
+		diskd_io_req_t *req = gIter->data;
+
+		next = gIter->next;
+		if (syscall(__NR_io_cancel, req->ring->ctx, &req->iocb, &ev) == 0) {
+			aio_req_done(req, (long)ev.res);
+		}
+	}
+}
+
+static gboolean
+aio_deadline(gpointer data)
+{
+	diskd_io_req_t *req = data;
+	struct io_event ev;
+
+	req->timer_id = 0;
+	if (syscall(__NR_io_cancel, req->ring->ctx, &req->iocb, &ev) == 0) {
+		/* the event comes back here, not on the ring */
+		diskd_io_complete(req, -1, ETIMEDOUT);
+		aio_req_done(req, (long)ev.res);
+		return FALSE;
+	}
+	/* mostly fails for a hung device, the completion then frees req later */
+	req->abandoned = TRUE;
+	req->ring->abandoned++;
+	diskd_io_complete(req, -1, ETIMEDOUT);
+	if (req->ring == aio_cur && aio_cur->abandoned > AIO_ABANDONED_MAX) {
+		aio_retire();
+	}
+	return FALSE;
+}
+
+static int
+aio_submit(int fd, gboolean write, off_t offset, int timeout, diskd_io_req_t *req)
+{
+	struct iocb *iocbp = &req->iocb;
+
+	if (aio_cur->abandoned > AIO_ABANDONED_MAX) {
+		/* no context left to replace it */
+		return -EBUSY;
+	}
+
+	memset(iocbp, 0, sizeof(*iocbp));
+	iocbp->aio_data = (uint64_t)(uintptr_t)req;
+	iocbp->aio_lio_opcode = (write)? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+	iocbp->aio_fildes = fd;
+	iocbp->aio_buf = (uint64_t)(uintptr_t)req->iov.iov_base;
+	iocbp->aio_nbytes = req->iov.iov_len;
+	iocbp->aio_offset = offset;
+	iocbp->aio_flags = IOCB_FLAG_RESFD;
+	iocbp->aio_resfd = io_efd;
+
+	if (syscall(__NR_io_submit, aio_cur->ctx, 1, &iocbp) != 1) {
+		return -errno;
+	}
+	req->pending = 1;
+	req->ring = aio_cur;
+	aio_cur->inflight++;
+	req->timer_id = g_timeout_add(timeout * 1000, aio_deadline, req);
+	return 0;
+}
+
+static void
+aio_reap_ring(aio_ring_t *ring)
+{
+	struct io_event events[IO_REAP_BATCH];
+	struct timespec ts = { 0, 0 };
+	long n, i;
+
+	do {
+		n = syscall(__NR_io_getevents, ring->ctx, 0, IO_REAP_BATCH, events, &ts);
+		for (i = 0; i < n; i++) {
+			aio_req_done((diskd_io_req_t *)(uintptr_t)events[i].data, (long)events[i].res);
+		}
+	} while (n == IO_REAP_BATCH);
+}
+
+static void
+aio_reap(void)
+{
+	GList *gIter, *next;
+
+	aio_reap_ring(aio_cur);
+	for (gIter = aio_retired; gIter != NULL; gIter = next) {
+		aio_ring_t *ring = gIter->data;
+
+		next = gIter->next;
+		aio_reap_ring(ring);
+		if (ring->inflight == 0) {
+			syscall(__NR_io_destroy, ring->ctx);
+			aio_retired = g_list_delete_link(aio_retired, gIter);
+			free(ring);
+		}
+	}
+}
+#endif /* DISKD_USE_AIO */
+
+/* ------------------------------------------------------------ worker pool */
+
+/*
+ * Each request is run by a helper process with a blocking pread/pwrite.
+ * The fd is passed over a SOCK_SEQPACKET socketpair and the data goes
+ * through a shared buffer. A worker past its deadline may be stuck in
+ * uninterruptible sleep: it is killed and abandoned, and a new one is
+ * forked for the next request.
+ */
+
+#define WORKER_MIN		2	/* forked by diskd_io_init() */
+#define WORKER_MAX		32	/* busy and idle workers */
+#define WORKER_STUCK_MAX	16	/* abandoned workers not yet reaped */
+#define WORKER_BUF_SIZE		(2 * 1024 * 1024)
+
+typedef struct worker_msg_s {
+	int write;
+	size_t len;
+	off_t offset;
+} worker_msg_t;
+
+typedef struct worker_reply_s {
+	ssize_t result;
+	int err;
+} worker_reply_t;
+
+typedef struct worker_s {
+	pid_t pid;
+	int sock;
+	void *buf;		/* shared with the worker */
+	GIOChannel *channel;
+	guint watch_id;
+	diskd_io_req_t *req;	/* NULL while idle */
+	guint timer_id;
+} worker_t;
+
+static GList *workers = NULL;
+static int workers_stuck = 0;
+
+static ssize_t
+worker_recv_fd(int sock, worker_msg_t *msg, int *fd)
+{
+	struct msghdr mh;
+	struct iovec iov = { msg, sizeof(*msg) };
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	ssize_t rc;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	*fd = -1;
+	rc = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (rc > 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return rc;
+}
+
+static int
+worker_send_fd(int sock, worker_msg_t *msg, int fd)
+{
+	struct msghdr mh;
+	struct iovec iov = { msg, sizeof(*msg) };
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return (sendmsg(sock, &mh, MSG_NOSIGNAL) < 0)? -errno : 0;
+}
+
+/*
+ * Keep only sock and /dev/null on 0-2 in the worker. An inherited fd
+ * would keep e.g. the -y pipe or a client socket of diskd open.
+ */
+static int
+worker_close_fds(int sock, long maxfd)
+{
+	int null_fd;
+	long fd;
+
+	if (sock <= STDERR_FILENO) {
+		fd = fcntl(sock, F_DUPFD, STDERR_FILENO + 1);
+		if (fd < 0) {
+			return -1;
+		}
+		sock = fd;
+	}
+	null_fd = open("/dev/null", O_RDWR);
+	if (null_fd < 0) {
+		return -1;
+	}
+	for (fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+		if (fd != null_fd && dup2(null_fd, fd) < 0) {
+			return -1;
+		}
+	}
+
+#ifdef SYS_close_range
+	if ((sock == STDERR_FILENO + 1
+	     || syscall(SYS_close_range, STDERR_FILENO + 1, sock - 1, 0) == 0)
+	    && syscall(SYS_close_range, sock + 1, ~0U, 0) == 0) {
+		return sock;
+	}
+#endif
+	for (fd = STDERR_FILENO + 1; fd < maxfd; fd++) {
+		if (fd != sock) {
+			close(fd);
+		}
+	}
+	return sock;
+}
+
+/* body of the worker process; only async-signal-safe calls after fork() */
+static void
+worker_main(int sock, void *buf, pid_t parent, long maxfd)
+{
+	worker_msg_t msg;
+	worker_reply_t reply;
+	int fd;
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != parent) {
+		/* diskd died before the prctl() */
+		_exit(0);
+	}
+	sock = worker_close_fds(sock, maxfd);
+	if (sock < 0) {
+		_exit(1);
+	}
+
+	while (worker_recv_fd(sock, &msg, &fd) == sizeof(msg)) {
+		if (fd < 0) {
+			reply.result = -1;
+			reply.err = EBADF;
+		} else {
+			if (msg.write) {
+				reply.result = pwrite(fd, buf, msg.len, msg.offset);
+			} else {
+				reply.result = pread(fd, buf, msg.len, msg.offset);
+			}
+			reply.err = (reply.result < 0)? errno : 0;
+			close(fd);
+		}
+		if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+			break;
+		}
+	}
+	_exit(0);
+}
+
+static void
+worker_reaped(GPid pid, gint status, gpointer data)
+{
+	gboolean stuck = GPOINTER_TO_INT(data);
+
+	crm_trace("I/O worker %d exited (status %d)", (int)pid, status);
+	if (stuck) {
+		workers_stuck--;
+		crm_info("Abandoned I/O worker %d has exited", (int)pid);
+	}
+	g_spawn_close_pid(pid);
+}
+
+static void
+worker_free(worker_t *w, gboolean stuck)
+{
+	if (w->timer_id != 0) {
+		g_source_remove(w->timer_id);
+	}
+	if (w->watch_id != 0) {
+		g_source_remove(w->watch_id);
+	}
+	if (w->channel != NULL) {
+		g_io_channel_unref(w->channel);
+	}
+	close(w->sock);
+	munmap(w->buf, WORKER_BUF_SIZE);
+	if (stuck) {
+		/* delivered once the I/O returns, if ever */
+		kill(w->pid, SIGKILL);
+		workers_stuck++;
+	}
+	g_child_watch_add(w->pid, worker_reaped, GINT_TO_POINTER(stuck));
+	workers = g_list_remove(workers, w);
+	free(w);
+}
+
+static gboolean
+worker_dispatch(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	worker_t *w = data;
+	diskd_io_req_t *req = w->req;
+	worker_reply_t reply;
+	ssize_t rc;
+
+	rc = recv(w->sock, &reply, sizeof(reply), MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return TRUE;
+	}
+	if (rc != sizeof(reply)) {
+		crm_err("I/O worker %d went away", (int)w->pid);
+		w->watch_id = 0;	/* removed by returning FALSE */
+		worker_free(w, FALSE);
+		if (req != NULL) {
+			diskd_io_complete(req, -1, EIO);
+			free(req);
+		}
+		return FALSE;
+	}
+
+	if (req != NULL) {
+		g_source_remove(w->timer_id);
+		w->timer_id = 0;
+		w->req = NULL;
+		if (reply.result > 0 && !req->write) {
+			memcpy(req->iov.iov_base, w->buf, reply.result);
+		}
+		diskd_io_complete(req, reply.result, reply.err);
+		free(req);
+	}
+	return TRUE;
+}
+
+static gboolean
+worker_deadline(gpointer data)
+{
+	worker_t *w = data;
+	diskd_io_req_t *req = w->req;
+
+	w->timer_id = 0;
+	crm_warn("I/O worker %d is stuck, abandoned", (int)w->pid);
+	worker_free(w, TRUE);
+	diskd_io_complete(req, -1, ETIMEDOUT);
+	free(req);
+	return FALSE;
+}
+
+static worker_t *
+worker_spawn(void)
+{
+	worker_t *w;
+	pid_t parent = getpid();
+	long maxfd = sysconf(_SC_OPEN_MAX);
+	int sv[2];
+
+	if (g_list_length(workers) >= WORKER_MAX || workers_stuck >= WORKER_STUCK_MAX) {
+		crm_warn("No I/O worker available (%d running, %d stuck)",
+			g_list_length(workers), workers_stuck);
+		return NULL;
+	}
+
+	w = calloc(1, sizeof(worker_t));
+	if (w == NULL) {
+		return NULL;
+	}
+	w->buf = mmap(NULL, WORKER_BUF_SIZE, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (w->buf == MAP_FAILED) {
+		crm_perror(LOG_ERR, "mmap of the I/O worker buffer");
+		free(w);
+		return NULL;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		crm_perror(LOG_ERR, "socketpair for the I/O worker");
+		munmap(w->buf, WORKER_BUF_SIZE);
+		free(w);
+		return NULL;
+	}
+
+	w->pid = fork();
+	if (w->pid < 0) {
+		crm_perror(LOG_ERR, "fork of the I/O worker");
+		close(sv[0]);
+		close(sv[1]);
+		munmap(w->buf, WORKER_BUF_SIZE);
+		free(w);
+		return NULL;
+	}
+	if (w->pid == 0) {
+		worker_main(sv[1], w->buf, parent, (maxfd > 0)? maxfd : 1024);
+	}
+	close(sv[1]);
+
+	w->sock = sv[0];
+	w->channel = g_io_channel_unix_new(w->sock);
+	w->watch_id = g_io_add_watch(w->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, worker_dispatch, w);
+	workers = g_list_append(workers, w);
+	crm_debug("I/O worker %d started", (int)w->pid);
+	return w;
+}
+
+static gboolean
+worker_init(void)
+{
+	int i;
+
+	for (i = 0; i < WORKER_MIN; i++) {
+		if (worker_spawn() == NULL) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void
+worker_fini(void)
+{
+	/* an idle worker exits on the end of file of its socket */
+	while (workers != NULL) {
+		worker_t *w = workers->data;
+		diskd_io_req_t *req = w->req;
+
+		/* the owners of the requests are gone already */
+		worker_free(w, (req != NULL));
+		free(req);
+	}
+}
+
+static int
+worker_submit(int fd, gboolean write, off_t offset, int timeout, diskd_io_req_t *req)
+{
+	worker_msg_t msg;
+	worker_t *w = NULL;
+	GList *gIter;
+	int rc;
+
+	if (req->iov.iov_len > WORKER_BUF_SIZE) {
+		return -EINVAL;
+	}
+	for (gIter = workers; gIter != NULL; gIter = gIter->next) {
+		if (((worker_t *)gIter->data)->req == NULL) {
+			w = gIter->data;
+			break;
+		}
+	}
+	if (w == NULL && (w = worker_spawn()) == NULL) {
+		return -EAGAIN;
+	}
+
+	if (write) {
+		memcpy(w->buf, req->iov.iov_base, req->iov.iov_len);
+	}
+	req->write = write;
+	msg.write = write;
+	msg.len = req->iov.iov_len;
+	msg.offset = offset;
+	rc = worker_send_fd(w->sock, &msg, fd);
+	if (rc < 0) {
+		return rc;
+	}
+	w->req = req;
+	w->timer_id = g_timeout_add(timeout * 1000, worker_deadline, w);
+	return 0;
+}
+
+/* ------------------------------------------------------------------ common */
+
+static gboolean
+diskd_io_dispatch(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	uint64_t count;
+
+	if (read(io_efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		crm_perror(LOG_ERR, "read from I/O eventfd");
+	}
+
+#ifdef DISKD_USE_URING
+	if (io_engine == DISKD_IO_URING) {
+		uring_reap();
+	}
+#endif
+#ifdef DISKD_USE_AIO
+	if (io_engine == DISKD_IO_AIO) {
+		aio_reap();
+	}
+#endif
+	return TRUE;
+}
+
+int
+diskd_io_engine_parse(const char *name)
+{
+	if (name == NULL || strcmp(name, "auto") == 0) {
+		return DISKD_IO_AUTO;
+	} else if (strcmp(name, "sync") == 0) {
+		return DISKD_IO_SYNC;
+	} else if (strcmp(name, "uring") == 0) {
+		return DISKD_IO_URING;
+	} else if (strcmp(name, "aio") == 0) {
+		return DISKD_IO_AIO;
+	} else if (strcmp(name, "worker") == 0) {
+		return DISKD_IO_WORKER;
+	}
+	return -1;
+}
+
+const char *
+diskd_io_engine_name(int engine)
+{
+	switch (engine) {
+		case DISKD_IO_SYNC:
+			return "sync";
+		case DISKD_IO_URING:
+			return "uring";
+		case DISKD_IO_AIO:
+			return "aio";
+		case DISKD_IO_WORKER:
+			return "worker";
+		case DISKD_IO_AUTO:
+			return "auto";
+	}
+	return "unknown";
+}
+
+int
+diskd_io_engine(void)
+{
+	return io_engine;
+}
+
+/*
+ * Set up the requested engine. "auto" tries io_uring, then Linux AIO,
+ * then the worker pool.
+ * Returns the engine in use; DISKD_IO_SYNC when no asynchronous engine
+ * could be set up.
+ */
+int
+diskd_io_init(int engine)
+{
+	io_engine = DISKD_IO_SYNC;
+	if (engine == DISKD_IO_SYNC) {
+		return io_engine;
+	}
+
+#ifdef HAVE_SYS_EVENTFD_H
+	if (engine != DISKD_IO_WORKER) {
+		io_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (io_efd < 0) {
+			crm_perror(LOG_ERR, "eventfd");
+		}
+	}
+
+#  ifdef DISKD_USE_URING
+	if (io_efd >= 0 && io_engine == DISKD_IO_SYNC
+	    && (engine == DISKD_IO_URING || engine == DISKD_IO_AUTO) && uring_init()) {
+		io_engine = DISKD_IO_URING;
+	}
+#  endif
+#  ifdef DISKD_USE_AIO
+	if (io_efd >= 0 && io_engine == DISKD_IO_SYNC
+	    && (engine == DISKD_IO_AIO || engine == DISKD_IO_AUTO) && aio_init()) {
+		io_engine = DISKD_IO_AIO;
+	}
+#  endif
+
+	if (io_engine != DISKD_IO_SYNC) {
+		io_channel = g_io_channel_unix_new(io_efd);
+		io_watch_id = g_io_add_watch(io_channel, G_IO_IN, diskd_io_dispatch, NULL);
+	} else if (io_efd >= 0) {
+		close(io_efd);
+		io_efd = -1;
+	}
+#else
+	if (engine == DISKD_IO_URING || engine == DISKD_IO_AIO) {
+		crm_warn("I/O engine %s is not supported by this build", diskd_io_engine_name(engine));
+	}
+#endif
+
+	if (io_engine == DISKD_IO_SYNC
+	    && (engine == DISKD_IO_WORKER || engine == DISKD_IO_AUTO)) {
+		if (worker_init()) {
+			io_engine = DISKD_IO_WORKER;
+		} else {
+			worker_fini();
+		}
+	}
+
+	if (io_engine == DISKD_IO_SYNC) {
+		crm_warn("I/O engine %s is not available, disk checks block the main loop",
+			diskd_io_engine_name(engine));
+		return io_engine;
+	}
+	crm_info("I/O engine: %s", diskd_io_engine_name(io_engine));
+	return io_engine;
+}
+
+/*
+ * Cancel the requests still owned by the kernel and reap them, for at
+ * most IO_FINI_WAIT. FALSE: some are left, the kernel may still write
+ * to their buffers.
+ */
+static gboolean
+io_drain(void)
+{
+	gint64 end = g_get_monotonic_time() + IO_FINI_WAIT * G_TIME_SPAN_SECOND;
+	struct pollfd pfd;
+	gint64 left;
+
+#ifdef DISKD_USE_URING
+	if (io_engine == DISKD_IO_URING) {
+		uring_cancel_all();
+	}
+#endif
+#ifdef DISKD_USE_AIO
+	if (io_engine == DISKD_IO_AIO) {
+		aio_cancel_all();
+	}
+#endif
+	while (io_kernel_reqs != NULL) {
+		left = end - g_get_monotonic_time();
+		if (left <= 0) {
+			crm_warn("%d I/O requests are still in flight, their buffers are left allocated",
+				g_list_length(io_kernel_reqs));
+			return FALSE;
+		}
+		pfd.fd = io_efd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, (int)(left / 1000) + 1) > 0) {
+			diskd_io_dispatch(NULL, G_IO_IN, NULL);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Stop the engine. No callback is called any more. FALSE: the kernel may
+ * still write to the buffers of some requests, they must not be freed.
+ */
+gboolean
+diskd_io_fini(void)
+{
+	gboolean drained = TRUE;
+
+	io_closing = TRUE;
+	if (io_efd >= 0 && io_engine != DISKD_IO_WORKER) {
+		drained = io_drain();
+	}
+	if (io_watch_id != 0) {
+		g_source_remove(io_watch_id);
+		io_watch_id = 0;
+	}
+	if (io_channel != NULL) {
+		g_io_channel_unref(io_channel);
+		io_channel = NULL;
+	}
+#ifdef DISKD_USE_URING
+	uring_fini();
+#endif
+#ifdef DISKD_USE_AIO
+	aio_fini();
+#endif
+	worker_fini();
+	if (io_efd >= 0) {
+		close(io_efd);
+		io_efd = -1;
+	}
+	io_engine = DISKD_IO_SYNC;
+	io_closing = FALSE;
+	return drained;
+}
+
+static int
+io_submit_engine(int engine, int fd, gboolean write, void *buf, size_t len, off_t offset,
+		 int timeout, diskd_io_cb_t cb, gpointer user_data)
+{
+	diskd_io_req_t *req;
+	int rc = -EOPNOTSUPP;
+
+	req = calloc(1, sizeof(diskd_io_req_t));
+	if (req == NULL) {
+		return -ENOMEM;
+	}
+	req->cb = cb;
+	req->user_data = user_data;
+	req->iov.iov_base = buf;
+	req->iov.iov_len = len;
+
+#ifdef DISKD_USE_URING
+	if (engine == DISKD_IO_URING) {
+		rc = uring_submit(fd, write, offset, timeout, req);
+	}
+#endif
+#ifdef DISKD_USE_AIO
+	if (engine == DISKD_IO_AIO) {
+		rc = aio_submit(fd, write, offset, timeout, req);
+	}
+#endif
+	if (engine == DISKD_IO_WORKER) {
+		rc = worker_submit(fd, write, offset, timeout, req);
+	}
+	if (rc != 0) {
+		free(req);
+	} else if (engine != DISKD_IO_WORKER) {
+		io_kernel_reqs = g_list_prepend(io_kernel_reqs, req);
+	}
+	return rc;
+}
+
+/*
+ * Submit one read or write of len bytes at offset. cb is called from
+ * the main loop with the result, at the latest when timeout seconds
+ * have passed. Returns 0, or -errno when the request was not queued.
+ */
+int
+diskd_io_submit(int fd, gboolean write, void *buf, size_t len, off_t offset,
+		int timeout, diskd_io_cb_t cb, gpointer user_data)
+{
+	return io_submit_engine(io_engine, fd, write, buf, len, offset, timeout, cb, user_data);
+}
+
+/*
+ * The same for an fd opened without O_DIRECT. Linux AIO runs such a
+ * request synchronously inside io_submit(), so with that engine it goes
+ * to an I/O worker instead.
+ */
+int
+diskd_io_submit_buffered(int fd, gboolean write, void *buf, size_t len, off_t offset,
+			 int timeout, diskd_io_cb_t cb, gpointer user_data)
+{
+	int engine = (io_engine == DISKD_IO_AIO)? DISKD_IO_WORKER : io_engine;
+
+	return io_submit_engine(engine, fd, write, buf, len, offset, timeout, cb, user_data);
+}
@@ -0,0 +1,53 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   asynchronous disk check I/O engine.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_IO_H
+#define DISKD_IO_H
+
+#include <sys/types.h>
+#include <glib.h>
+
+/* I/O engine */
+#define DISKD_IO_SYNC		0	/* blocking read()/write() on the main loop */
+#define DISKD_IO_URING		1	/* io_uring + linked timeout */
+#define DISKD_IO_AIO		2	/* Linux AIO + main loop timer */
+#define DISKD_IO_AUTO		3	/* io_uring, then Linux AIO, then worker, then sync */
+#define DISKD_IO_WORKER		4	/* blocking I/O in helper processes */
+
+/*
+ * Completion callback, called from the main loop exactly once per request.
+ *   result : transferred bytes, or -1 on error
+ *   err    : errno of the failure (ETIMEDOUT when the deadline passed)
+ */
+typedef void (*diskd_io_cb_t)(gpointer user_data, ssize_t result, int err);
+
+extern int diskd_io_engine_parse(const char *name);
+extern const char *diskd_io_engine_name(int engine);
+extern int diskd_io_init(int engine);
+extern int diskd_io_engine(void);
+extern gboolean diskd_io_fini(void);
+extern int diskd_io_submit(int fd, gboolean write, void *buf, size_t len, off_t offset,
+			   int timeout, diskd_io_cb_t cb, gpointer user_data);
+extern int diskd_io_submit_buffered(int fd, gboolean write, void *buf, size_t len, off_t offset,
+				    int timeout, diskd_io_cb_t cb, gpointer user_data);
+
+#endif /* DISKD_IO_H */
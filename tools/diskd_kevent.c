@@ -0,0 +1,287 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   kernel event sources (kmsg, uevent).
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <crm/crm.h>
+
+#include "diskd_kevent.h"
+#include "diskd_mpath.h"
+
+#define KEVENT_BUF		8192
+
+/* kmsg messages about a failing block device */
+static const char *kmsg_patterns[] = {
+	"I/O error",			/* blk_update_request, print_req_error, buffer I/O */
+	"FAILED Result",		/* sd: command failed */
+	"Failing path",			/* device-mapper: multipath */
+	"offline device",		/* scsi: rejecting I/O to offline device */
+	"timing out command",
+	"Medium Error",
+	"Sense Key",
+	NULL
+};
+
+static diskd_kevent_cb_t kevent_cb = NULL;
+static int kmsg_fd = -1;
+static int uevent_fd = -1;
+static GIOChannel *kmsg_channel = NULL;
+static GIOChannel *uevent_channel = NULL;
+static guint kmsg_watch_id = 0;
+static guint uevent_watch_id = 0;
+
+/* Report the device of a "<major>:<minor>" string */
+static void
+kevent_report_devno(const char *majmin, const char *reason)
+{
+	unsigned int maj, min;
+	char *name;
+
+	if (sscanf(majmin, "%u:%u", &maj, &min) != 2) {
+		return;
+	}
+	name = diskd_mpath_name(makedev(maj, min));
+	if (name != NULL) {
+		kevent_cb(name, reason);
+		free(name);
+	}
+}
+
+/* Copy the device name starting at p, up to a separator */
+static gboolean
+kevent_name(const char *p, char *name, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len - 1 && p[i] != '\0' && (isalnum((unsigned char)p[i])
+	     || p[i] == '-' || p[i] == '_' || p[i] == '!'); i++) {
+		name[i] = p[i];
+	}
+	name[i] = '\0';
+	return i > 0 && !isdigit((unsigned char)name[0]);
+}
+
+/*
+ * One kmsg record: "<prio>,<seq>,<usec>,<flags>;<message>\n" followed by
+ * " KEY=value\n" lines, e.g. " DEVICE=b8:16".
+ */
+static void
+kmsg_record(char *rec)
+{
+	char name[64];
+	char *msg, *eol, *p;
+	int i;
+
+	msg = strchr(rec, ';');
+	if (msg == NULL) {
+		return;
+	}
+	msg++;
+	eol = strchr(msg, '\n');
+	if (eol != NULL) {
+		*eol = '\0';
+	}
+
+	for (i = 0; kmsg_patterns[i] != NULL; i++) {
+		if (strstr(msg, kmsg_patterns[i]) != NULL) {
+			break;
+		}
+	}
+	if (kmsg_patterns[i] == NULL) {
+		return;
+	}
+
+	if ((p = strstr(msg, "Failing path ")) != NULL) {
+		kevent_report_devno(p + strlen("Failing path "), msg);
+	} else if ((p = strstr(msg, "dev ")) != NULL && kevent_name(p + 4, name, sizeof(name))) {
+		/* "I/O error, dev sdb, sector 0", "Buffer I/O error on dev sdb1, ..." */
+		kevent_cb(name, msg);
+	} else if ((p = strchr(msg, '[')) != NULL && kevent_name(p + 1, name, sizeof(name))) {
+		/* "sd 2:0:0:0: [sdb] tag#0 FAILED Result: ..." */
+		kevent_cb(name, msg);
+	} else if (eol != NULL && (p = strstr(eol + 1, " DEVICE=b")) != NULL) {
+		kevent_report_devno(p + strlen(" DEVICE=b"), msg);
+	}
+}
+
+static gboolean
+kmsg_dispatch(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	char rec[KEVENT_BUF];
+	ssize_t len;
+
+	while (1) {
+		len = read(kmsg_fd, rec, sizeof(rec) - 1);
+		if (len < 0) {
+			if (errno == EPIPE) {
+				/* overwritten before read, go on with the next one */
+				continue;
+			}
+			if (errno != EAGAIN && errno != EINTR) {
+				crm_perror(LOG_WARNING, "read from /dev/kmsg");
+			}
+			break;
+		}
+		if (len == 0) {
+			break;
+		}
+		rec[len] = '\0';
+		kmsg_record(rec);
+	}
+	return TRUE;
+}
+
+/* One uevent: "<action>@<devpath>\0KEY=value\0..." */
+static void
+uevent_message(char *buf, ssize_t len)
+{
+	const char *action = NULL, *subsystem = NULL, *devname = NULL;
+	const char *dm_action = NULL, *dm_path = NULL;
+	char reason[128];
+	char *p;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0) {
+			action = p + 7;
+		} else if (strncmp(p, "SUBSYSTEM=", 10) == 0) {
+			subsystem = p + 10;
+		} else if (strncmp(p, "DEVNAME=", 8) == 0) {
+			devname = p + 8;
+			if (strncmp(devname, "/dev/", 5) == 0) {
+				devname += 5;
+			}
+		} else if (strncmp(p, "DM_ACTION=", 10) == 0) {
+			dm_action = p + 10;
+		} else if (strncmp(p, "DM_PATH=", 8) == 0) {
+			dm_path = p + 8;
+		}
+	}
+	if (action == NULL || subsystem == NULL || strcmp(subsystem, "block") != 0) {
+		return;
+	}
+
+	if (dm_action != NULL && strcmp(dm_action, "PATH_FAILED") == 0 && dm_path != NULL) {
+		g_snprintf(reason, sizeof(reason), "uevent: path %s failed", dm_path);
+		kevent_report_devno(dm_path, reason);
+	} else if (devname != NULL && (strcmp(action, "remove") == 0 || strcmp(action, "offline") == 0)) {
+		g_snprintf(reason, sizeof(reason), "uevent: %s %s", action, devname);
+		kevent_cb(devname, reason);
+	}
+}
+
+static gboolean
+uevent_dispatch(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	char buf[KEVENT_BUF];
+	ssize_t len;
+
+	while ((len = recv(uevent_fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+		buf[len] = '\0';
+		uevent_message(buf, len);
+	}
+	return TRUE;
+}
+
+gboolean
+diskd_kevent_start(diskd_kevent_cb_t cb)
+{
+	struct sockaddr_nl addr;
+
+	kevent_cb = cb;
+
+	kmsg_fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (kmsg_fd < 0) {
+		crm_perror(LOG_WARNING, "/dev/kmsg");
+	} else {
+		/* only the messages from now on */
+		lseek(kmsg_fd, 0, SEEK_END);
+		kmsg_channel = g_io_channel_unix_new(kmsg_fd);
+		kmsg_watch_id = g_io_add_watch(kmsg_channel, G_IO_IN, kmsg_dispatch, NULL);
+	}
+
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd >= 0) {
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+		addr.nl_groups = 1;	/* kernel uevents */
+		if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			close(uevent_fd);
+			uevent_fd = -1;
+		}
+	}
+	if (uevent_fd < 0) {
+		crm_perror(LOG_WARNING, "uevent socket");
+	} else {
+		uevent_channel = g_io_channel_unix_new(uevent_fd);
+		uevent_watch_id = g_io_add_watch(uevent_channel, G_IO_IN, uevent_dispatch, NULL);
+	}
+
+	if (kmsg_fd < 0 && uevent_fd < 0) {
+		return FALSE;
+	}
+	crm_info("kernel events:%s%s", (kmsg_fd >= 0)? " kmsg" : "", (uevent_fd >= 0)? " uevent" : "");
+	return TRUE;
+}
+
+void
+diskd_kevent_stop(void)
+{
+	if (kmsg_watch_id != 0) {
+		g_source_remove(kmsg_watch_id);
+		kmsg_watch_id = 0;
+	}
+	if (kmsg_channel != NULL) {
+		g_io_channel_unref(kmsg_channel);
+		kmsg_channel = NULL;
+	}
+	if (kmsg_fd >= 0) {
+		close(kmsg_fd);
+		kmsg_fd = -1;
+	}
+	if (uevent_watch_id != 0) {
+		g_source_remove(uevent_watch_id);
+		uevent_watch_id = 0;
+	}
+	if (uevent_channel != NULL) {
+		g_io_channel_unref(uevent_channel);
+		uevent_channel = NULL;
+	}
+	if (uevent_fd >= 0) {
+		close(uevent_fd);
+		uevent_fd = -1;
+	}
+}
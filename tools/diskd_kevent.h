@@ -0,0 +1,39 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   kernel event sources (kmsg, uevent).
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_KEVENT_H
+#define DISKD_KEVENT_H
+
+#include <glib.h>
+
+/*
+ * Called on the main loop for a kernel report about a block device:
+ *   name   : kernel name of the device ("sdc", "dm-3", ...)
+ *   reason : the kernel message or the uevent action
+ */
+typedef void (*diskd_kevent_cb_t)(const char *name, const char *reason);
+
+/* Listen to /dev/kmsg and to the kernel uevents. FALSE: neither is available. */
+extern gboolean diskd_kevent_start(diskd_kevent_cb_t cb);
+extern void diskd_kevent_stop(void);
+
+#endif /* DISKD_KEVENT_H */
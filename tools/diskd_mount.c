@@ -0,0 +1,91 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   mount table watcher.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+/*
+ * The kernel flags /proc/self/mountinfo with POLLPRI | POLLERR whenever
+ * the mount table of the namespace changes, a remount included. No disk
+ * I/O is involved.
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <crm/crm.h>
+
+#include "diskd_mount.h"
+
+#define MOUNTINFO		"/proc/self/mountinfo"
+
+static diskd_mount_cb_t mount_cb = NULL;
+static int mount_fd = -1;
+static GIOChannel *mount_channel = NULL;
+static guint mount_watch_id = 0;
+
+static gboolean
+mount_dispatch(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	crm_debug("mount table changed");
+	mount_cb();
+	return TRUE;
+}
+
+gboolean
+diskd_mount_start(diskd_mount_cb_t cb)
+{
+	mount_cb = cb;
+
+	mount_fd = open(MOUNTINFO, O_RDONLY | O_CLOEXEC);
+	if (mount_fd < 0) {
+		crm_perror(LOG_WARNING, "%s", MOUNTINFO);
+		return FALSE;
+	}
+	mount_channel = g_io_channel_unix_new(mount_fd);
+	mount_watch_id = g_io_add_watch(mount_channel, G_IO_PRI | G_IO_ERR, mount_dispatch, NULL);
+	crm_info("watching %s", MOUNTINFO);
+	return TRUE;
+}
+
+void
+diskd_mount_stop(void)
+{
+	if (mount_watch_id != 0) {
+		g_source_remove(mount_watch_id);
+		mount_watch_id = 0;
+	}
+	if (mount_channel != NULL) {
+		g_io_channel_unref(mount_channel);
+		mount_channel = NULL;
+	}
+	if (mount_fd >= 0) {
+		close(mount_fd);
+		mount_fd = -1;
+	}
+}
@@ -0,0 +1,35 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   mount table watcher.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_MOUNT_H
+#define DISKD_MOUNT_H
+
+#include <glib.h>
+
+/* Called on the main loop when a file system is mounted, unmounted or remounted */
+typedef void (*diskd_mount_cb_t)(void);
+
+/* Poll /proc/self/mountinfo for changes. FALSE: it cannot be watched. */
+extern gboolean diskd_mount_start(diskd_mount_cb_t cb);
+extern void diskd_mount_stop(void);
+
+#endif /* DISKD_MOUNT_H */
@@ -0,0 +1,163 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   multipath slave path discovery.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+#include <crm/crm.h>
+
+#include "diskd_mpath.h"
+
+#define SYS_BLOCK		"/sys/class/block"
+#define MAX_MPATH_DEPTH		4	/* dm on dm on ... */
+
+static GList *
+mpath_slaves_of(const char *sysdir, int depth, GList *list)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *ent;
+
+	g_snprintf(path, sizeof(path), "%s/slaves", sysdir);
+	dir = opendir(path);
+	if (dir == NULL) {
+		return list;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		char child[PATH_MAX];
+		GList *leaves;
+
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		g_snprintf(child, sizeof(child), SYS_BLOCK "/%s", ent->d_name);
+		leaves = NULL;
+		if (depth < MAX_MPATH_DEPTH) {
+			leaves = mpath_slaves_of(child, depth + 1, NULL);
+		}
+		if (leaves != NULL) {
+			list = g_list_concat(list, leaves);
+		} else {
+			list = g_list_append(list, strdup(ent->d_name));
+		}
+	}
+	closedir(dir);
+	return list;
+}
+
+GList *
+diskd_mpath_slaves(const char *device)
+{
+	char sysdir[PATH_MAX];
+	struct stat st;
+
+	if (stat(device, &st) < 0) {
+		crm_perror(LOG_WARNING, "%s", device);
+		return NULL;
+	}
+	if (!S_ISBLK(st.st_mode)) {
+		return NULL;
+	}
+
+	g_snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u",
+		major(st.st_rdev), minor(st.st_rdev));
+	return mpath_slaves_of(sysdir, 0, NULL);
+}
+
+char *
+diskd_mpath_name(dev_t devno)
+{
+	char sysdir[PATH_MAX];
+	char link[PATH_MAX];
+	ssize_t len;
+
+	g_snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u", major(devno), minor(devno));
+	len = readlink(sysdir, link, sizeof(link) - 1);
+	if (len <= 0) {
+		return NULL;
+	}
+	link[len] = '\0';
+	return strdup(basename(link));
+}
+
+GList *
+diskd_mpath_related(dev_t devno)
+{
+	char sysdir[PATH_MAX];
+	char link[PATH_MAX];
+	char *p;
+	ssize_t len;
+	GList *list = NULL;
+
+	g_snprintf(sysdir, sizeof(sysdir), "/sys/dev/block/%u:%u", major(devno), minor(devno));
+	len = readlink(sysdir, link, sizeof(link) - 1);
+	if (len <= 0) {
+		return NULL;
+	}
+	link[len] = '\0';
+
+	p = strrchr(link, '/');
+	if (p == NULL) {
+		return NULL;
+	}
+	list = g_list_append(list, strdup(p + 1));
+
+	/* ".../block/sdb/sdb1": the whole disk of a partition */
+	*p = '\0';
+	p = strrchr(link, '/');
+	if (p != NULL && strcmp(p + 1, "block") != 0) {
+		list = g_list_append(list, strdup(p + 1));
+	}
+
+	return mpath_slaves_of(sysdir, 0, list);
+}
+
+char *
+diskd_mpath_devnode(const char *name)
+{
+	char *devnode = calloc(1, PATH_MAX);
+	char *p;
+
+	if (devnode != NULL) {
+		g_snprintf(devnode, PATH_MAX, "/dev/%s", name);
+		/* sysfs names "cciss!c0d0" for /dev/cciss/c0d0 */
+		for (p = devnode; *p != '\0'; p++) {
+			if (*p == '!') {
+				*p = '/';
+			}
+		}
+	}
+	return devnode;
+}
@@ -0,0 +1,51 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   multipath slave path discovery.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_MPATH_H
+#define DISKD_MPATH_H
+
+#include <sys/types.h>
+#include <glib.h>
+
+/*
+ * Underlying paths of a device-mapper device, from
+ * /sys/dev/block/<major>:<minor>/slaves. Stacked dm devices (e.g. LVM on
+ * multipath) are followed down to the leaf devices.
+ * Returns a list of kernel names ("sdc", ...) to be freed with
+ * g_list_free_full(list, free), or NULL when the device has no slaves.
+ */
+extern GList *diskd_mpath_slaves(const char *device);
+
+/* kernel name of a block device, to be freed with free(). NULL: unknown */
+extern char *diskd_mpath_name(dev_t devno);
+
+/*
+ * Kernel names related to a block device: its own, that of the whole
+ * disk for a partition, and those of its slave paths. To be freed with
+ * g_list_free_full(list, free).
+ */
+extern GList *diskd_mpath_related(dev_t devno);
+
+/* "/dev/<name>" of a kernel device name, to be freed with free() */
+extern char *diskd_mpath_devnode(const char *name);
+
+#endif /* DISKD_MPATH_H */
@@ -0,0 +1,124 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   flight recorder of the recent disk checks.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <crm/crm.h>
+
+#include "diskd_recorder.h"
+
+static diskd_record_t ring[DISKD_RECORDER_SIZE];
+static guint64 ring_next = 0;	/* records added so far */
+
+static const char *result_name[] = { "failed", "normal", "degraded", "ERROR" };
+
+void
+diskd_recorder_add(const diskd_record_t *rec)
+{
+	ring[ring_next % DISKD_RECORDER_SIZE] = *rec;
+	ring_next++;
+}
+
+static void
+recorder_latency(FILE *fp, const char *name, gint32 usec)
+{
+	if (usec < 0) {
+		fprintf(fp, " %s=-", name);
+	} else {
+		fprintf(fp, " %s=%dus", name, usec);
+	}
+}
+
+static void
+recorder_time(char *buf, size_t len, gint64 usec)
+{
+	time_t sec = usec / G_TIME_SPAN_SECOND;
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+	snprintf(buf + strlen(buf), len - strlen(buf), ".%06d", (int)(usec % G_TIME_SPAN_SECOND));
+}
+
+gboolean
+diskd_recorder_dump(const char *path, const char *reason)
+{
+	char old[PATH_MAX];
+	char when[64];
+	guint64 i, first;
+	FILE *fp;
+
+	snprintf(old, sizeof(old), "%s.1", path);
+	if (rename(path, old) < 0 && errno != ENOENT) {
+		crm_perror(LOG_WARNING, "rename %s", path);
+	}
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		crm_perror(LOG_WARNING, "flight recorder %s", path);
+		return FALSE;
+	}
+
+	recorder_time(when, sizeof(when), g_get_real_time());
+	first = (ring_next > DISKD_RECORDER_SIZE)? ring_next - DISKD_RECORDER_SIZE : 0;
+	fprintf(fp, "# diskd flight recorder, pid %d, %s: %s\n", (int)getpid(), when, reason);
+	fprintf(fp, "# %llu of %llu records\n", (unsigned long long)(ring_next - first),
+		(unsigned long long)ring_next);
+
+	for (i = first; i < ring_next; i++) {
+		const diskd_record_t *rec = &ring[i % DISKD_RECORDER_SIZE];
+
+		recorder_time(when, sizeof(when), rec->time);
+		fprintf(fp, "%s attr_name=%s target=%s attempt=%d", when, rec->attr_name,
+			rec->target, rec->attempt);
+		if (rec->offset >= 0) {
+			fprintf(fp, " offset=%lld", (long long)rec->offset);
+		} else {
+			fprintf(fp, " offset=-");
+		}
+		recorder_latency(fp, "open", rec->open);
+		recorder_latency(fp, "io", rec->io);
+		recorder_latency(fp, "verify", rec->verify);
+		recorder_latency(fp, "total", rec->total);
+		fprintf(fp, " result=%s", result_name[rec->result]);
+		if (rec->err != 0) {
+			fprintf(fp, " errno=%d (%s)", rec->err, strerror(rec->err));
+		}
+		fputc('\n', fp);
+	}
+
+	if (fclose(fp) != 0) {
+		crm_perror(LOG_WARNING, "flight recorder %s", path);
+		return FALSE;
+	}
+	crm_notice("flight recorder written to %s (%s)", path, reason);
+	return TRUE;
+}
@@ -0,0 +1,55 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   flight recorder of the recent disk checks.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_RECORDER_H
+#define DISKD_RECORDER_H
+
+#include <glib.h>
+
+#define DISKD_RECORDER_SIZE	4096	/* records kept */
+
+/* result of a record */
+#define DISKD_REC_FAILED	0	/* an attempt failed, the check may retry */
+#define DISKD_REC_NORMAL	1	/* the check ended with this status */
+#define DISKD_REC_DEGRADED	2
+#define DISKD_REC_ERROR		3
+
+typedef struct diskd_record_s {
+	gint64 time;		/* wall clock [us] */
+	const char *attr_name;	/* owned by the target */
+	const char *target;
+	gint64 offset;		/* -1: unknown */
+	gint32 open;		/* [us] latency of the phases, -1: not run */
+	gint32 io;
+	gint32 verify;
+	gint32 total;
+	gint16 attempt;
+	gint16 result;
+	gint32 err;
+} diskd_record_t;
+
+/* Copy rec into the ring, overwriting the oldest record. No allocation. */
+extern void diskd_recorder_add(const diskd_record_t *rec);
+/* Write the ring to path, oldest first; the previous dump is kept as path.1 */
+extern gboolean diskd_recorder_dump(const char *path, const char *reason);
+
+#endif /* DISKD_RECORDER_H */
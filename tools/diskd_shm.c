@@ -0,0 +1,199 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   shared memory status page.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <crm/crm.h>
+
+#include "diskd_shm.h"
+
+#define SHM_READ_RETRY		1000
+
+static diskd_shm_t *shm = NULL;
+static size_t shm_size = 0;
+static char *shm_path = NULL;
+
+static void
+shm_write_begin(void)
+{
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+shm_write_end(void)
+{
+	shm->updated = g_get_real_time();
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The page is built in a temporary file and renamed into place, so a
+ * reader never maps a half initialized one.
+ */
+gboolean
+diskd_shm_create(const char *path, int ntargets)
+{
+	char *tmp = g_strdup_printf("%s.%d", path, getpid());
+	int fd;
+
+	shm_size = DISKD_SHM_SIZE(ntargets);
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate(fd, shm_size) < 0) {
+		crm_perror(LOG_ERR, "status page %s", tmp);
+		goto fail;
+	}
+	shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		crm_perror(LOG_ERR, "mmap of %s", tmp);
+		shm = NULL;
+		goto fail;
+	}
+
+	shm->magic = DISKD_SHM_MAGIC;
+	shm->version = DISKD_SHM_VERSION;
+	shm->ntargets = ntargets;
+	shm->pid = getpid();
+	shm->started = g_get_real_time();
+	shm->updated = shm->started;
+
+	if (rename(tmp, path) < 0) {
+		crm_perror(LOG_ERR, "status page %s", path);
+		goto fail;
+	}
+	close(fd);
+	g_free(tmp);
+	shm_path = strdup(path);
+	crm_info("status page: %s", path);
+	return TRUE;
+
+fail:
+	if (shm != NULL) {
+		munmap(shm, shm_size);
+		shm = NULL;
+	}
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	g_free(tmp);
+	return FALSE;
+}
+
+/* Callers serialize the updates */
+void
+diskd_shm_update(int index, const diskd_shm_target_t *entry)
+{
+	if (shm == NULL || index < 0 || index >= shm->ntargets) {
+		return;
+	}
+	shm_write_begin();
+	memcpy(&shm->target[index], entry, sizeof(*entry));
+	shm_write_end();
+}
+
+void
+diskd_shm_close(void)
+{
+	if (shm == NULL) {
+		return;
+	}
+	/* a reader still holding the page sees that diskd has stopped */
+	shm_write_begin();
+	shm->pid = 0;
+	shm_write_end();
+	munmap(shm, shm_size);
+	shm = NULL;
+	unlink(shm_path);
+	free(shm_path);
+	shm_path = NULL;
+}
+
+const diskd_shm_t *
+diskd_shm_attach(const char *path, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(diskd_shm_t)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	if (((diskd_shm_t *)map)->magic != DISKD_SHM_MAGIC
+	    || ((diskd_shm_t *)map)->version != DISKD_SHM_VERSION
+	    || DISKD_SHM_SIZE(((diskd_shm_t *)map)->ntargets) > (size_t)st.st_size) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
+	return map;
+}
+
+void
+diskd_shm_detach(const diskd_shm_t *map, size_t size)
+{
+	munmap((void *)map, size);
+}
+
+/* copy must hold size bytes. FALSE: no consistent snapshot (writer stuck) */
+gboolean
+diskd_shm_snapshot(const diskd_shm_t *map, size_t size, diskd_shm_t *copy)
+{
+	guint32 seq;
+	int i;
+
+	for (i = 0; i < SHM_READ_RETRY; i++) {
+		seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy(copy, map, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+			copy->seq = seq;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
@@ -0,0 +1,76 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   shared memory status page.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_SHM_H
+#define DISKD_SHM_H
+
+#include <glib.h>
+
+/*
+ * Status page: a file (e.g. under /run) mapped by diskd and by any
+ * number of readers. diskd is the only writer; a reader takes a
+ * consistent snapshot with diskd_shm_snapshot(), without any syscall.
+ *
+ * seq is a seqlock: odd while the page is being written. A reader copies
+ * the page and retries when seq was odd or has changed meanwhile.
+ */
+#define DISKD_SHM_MAGIC		0x4d485344	/* "DSHM" */
+#define DISKD_SHM_VERSION	1
+
+typedef struct diskd_shm_target_s {
+	char attr_name[64];
+	char name[256];		/* device or write directory */
+	char status[16];	/* "normal", "degraded", "ERROR", "" (not checked yet) */
+	gint64 last_check;	/* real time [us] of the last finished check */
+	gint64 last_ok;		/* real time [us] of the last successful check */
+	guint64 checks;
+	guint64 errors;		/* failed checks */
+	gint64 last_latency;	/* [us] of the last check */
+	gint64 p50;		/* [us] total latency in the sliding window */
+	gint64 p99;
+	gint64 max;
+} diskd_shm_target_t;
+
+typedef struct diskd_shm_s {
+	guint32 magic;
+	guint32 version;
+	guint32 seq;
+	guint32 ntargets;
+	gint64 pid;		/* 0: diskd has stopped */
+	gint64 started;		/* real time [us] */
+	gint64 updated;		/* real time [us] */
+	diskd_shm_target_t target[];
+} diskd_shm_t;
+
+#define DISKD_SHM_SIZE(n)	(sizeof(diskd_shm_t) + (n) * sizeof(diskd_shm_target_t))
+
+/* writer (diskd) */
+extern gboolean diskd_shm_create(const char *path, int ntargets);
+extern void diskd_shm_update(int index, const diskd_shm_target_t *entry);
+extern void diskd_shm_close(void);
+
+/* reader */
+extern const diskd_shm_t *diskd_shm_attach(const char *path, size_t *size);
+extern void diskd_shm_detach(const diskd_shm_t *map, size_t size);
+extern gboolean diskd_shm_snapshot(const diskd_shm_t *map, size_t size, diskd_shm_t *copy);
+
+#endif /* DISKD_SHM_H */
@@ -0,0 +1,512 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   disk check latency statistics.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+
+#define _GNU_SOURCE		/* accept4() */
+
+#include <sys/param.h>
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <crm/crm.h>
+
+#include "diskd_stats.h"
+
+#define STATS_SLOT_LEN		(DISKD_STATS_WINDOW / DISKD_STATS_SLOTS)	/* [s] */
+#define STATS_REQUEST_WAIT	200	/* [ms] a client sending nothing gets the full report */
+#define STATS_REQUEST_MAX	64
+#define STATS_SEND_WAIT		5000	/* [ms] for a client to read the answer */
+
+typedef struct stats_client_s {
+	int fd;
+	GIOChannel *channel;
+	guint watch_id;
+	guint timer_id;
+	char request[STATS_REQUEST_MAX];
+	size_t len;
+	GString *out;		/* answer, NULL: not built yet */
+	gsize off;		/* sent so far */
+} stats_client_t;
+
+static const char *phase_name[DISKD_LAT_PHASES] = { "open", "io", "total", "verify" };
+
+static int stats_fd = -1;
+static char *stats_path = NULL;
+static GIOChannel *stats_channel = NULL;
+static guint stats_watch_id = 0;
+static diskd_stats_report_fn_t stats_report = NULL;
+
+const char *
+diskd_lat_phase_name(int phase)
+{
+	if (phase < 0 || phase >= DISKD_LAT_PHASES) {
+		return "unknown";
+	}
+	return phase_name[phase];
+}
+
+static int
+hist_index(gint64 usec)
+{
+	int msb;
+	int idx;
+
+	if (usec < 4) {
+		return (usec < 0)? 0 : (int)usec;
+	}
+	msb = 63 - __builtin_clzll((unsigned long long)usec);
+	idx = 4 * msb + (int)((usec >> (msb - 2)) & 3);
+	return MIN(idx, DISKD_HIST_BUCKETS - 1);
+}
+
+/* upper bound of the values counted in a bucket */
+static gint64
+hist_value(int idx)
+{
+	int msb = idx / 4;
+
+	if (msb < 2) {
+		/* 0-3 are counted exactly, 4-7 are never used */
+		return MIN(idx, 3);
+	}
+	return (1LL << msb) + (idx % 4 + 1) * (1LL << (msb - 2)) - 1;
+}
+
+static void
+hist_add(diskd_hist_t *hist, int idx, gint64 usec)
+{
+	hist->count[idx]++;
+	hist->n++;
+	hist->sum += usec;
+	if (usec > hist->max) {
+		hist->max = usec;
+	}
+}
+
+static void
+hist_merge(diskd_hist_t *dst, const diskd_hist_t *src)
+{
+	int i;
+
+	for (i = 0; i < DISKD_HIST_BUCKETS; i++) {
+		dst->count[i] += src->count[i];
+	}
+	dst->n += src->n;
+	dst->sum += src->sum;
+	dst->max = MAX(dst->max, src->max);
+}
+
+static gint64
+hist_percentile(const diskd_hist_t *hist, double q)
+{
+	guint64 rank = (guint64)(q * hist->n + 0.999999);
+	guint64 seen = 0;
+	int i;
+
+	if (hist->n == 0) {
+		return 0;
+	}
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < DISKD_HIST_BUCKETS; i++) {
+		seen += hist->count[i];
+		if (seen >= rank) {
+			return MIN(hist_value(i), hist->max);
+		}
+	}
+	return hist->max;
+}
+
+/*
+ * Samples of the buckets entirely at or below usec, i.e. a cumulative
+ * bucket of a histogram metric. A bucket straddling usec is counted in
+ * the next bound.
+ */
+guint64
+diskd_hist_count_le(const diskd_hist_t *hist, gint64 usec)
+{
+	guint64 n = 0;
+	int i;
+
+	for (i = 0; i < DISKD_HIST_BUCKETS && hist_value(i) <= usec; i++) {
+		n += hist->count[i];
+	}
+	return n;
+}
+
+static gint64
+current_epoch(void)
+{
+	return g_get_monotonic_time() / G_TIME_SPAN_SECOND / STATS_SLOT_LEN;
+}
+
+void
+diskd_lat_record(diskd_lat_t *lat, gint64 usec)
+{
+	gint64 epoch = current_epoch();
+	int slot = (int)(epoch % DISKD_STATS_SLOTS);
+	int idx = hist_index(usec);
+
+	if (lat->epoch[slot] != epoch) {
+		memset(&lat->window[slot], 0, sizeof(diskd_hist_t));
+		lat->epoch[slot] = epoch;
+	}
+	hist_add(&lat->window[slot], idx, usec);
+	hist_add(&lat->cumulative, idx, usec);
+}
+
+void
+diskd_lat_summary(const diskd_lat_t *lat, gboolean window, diskd_lat_summary_t *sum)
+{
+	diskd_hist_t merged;
+	const diskd_hist_t *hist = &lat->cumulative;
+
+	if (window) {
+		gint64 epoch = current_epoch();
+		int i;
+
+		memset(&merged, 0, sizeof(merged));
+		for (i = 0; i < DISKD_STATS_SLOTS; i++) {
+			if (lat->epoch[i] > epoch - DISKD_STATS_SLOTS) {
+				hist_merge(&merged, &lat->window[i]);
+			}
+		}
+		hist = &merged;
+	}
+
+	sum->n = hist->n;
+	sum->p50 = hist_percentile(hist, 0.50);
+	sum->p99 = hist_percentile(hist, 0.99);
+	sum->p999 = hist_percentile(hist, 0.999);
+	sum->max = hist->max;
+}
+
+/*
+ * Local query endpoint. A client may send one request line ("status",
+ * "stats"); it receives the answer and the connection is closed. A
+ * client sending nothing for STATS_REQUEST_WAIT gets the full report.
+ * An answer larger than the socket buffer is sent as the client reads
+ * it, for at most STATS_SEND_WAIT.
+ */
+static void
+stats_client_free(stats_client_t *client)
+{
+	if (client->timer_id != 0) {
+		g_source_remove(client->timer_id);
+	}
+	if (client->watch_id != 0) {
+		g_source_remove(client->watch_id);
+	}
+	g_io_channel_unref(client->channel);
+	close(client->fd);
+	if (client->out != NULL) {
+		g_string_free(client->out, TRUE);
+	}
+	free(client);
+}
+
+/* TRUE: the answer is sent or the client went away */
+static gboolean
+stats_client_send(stats_client_t *client)
+{
+	GString *out = client->out;
+	ssize_t rc;
+
+	while (client->off < out->len) {
+		rc = send(client->fd, out->str + client->off, out->len - client->off,
+			MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0 && errno == EAGAIN) {
+			return FALSE;
+		}
+		if (rc <= 0) {
+			crm_debug("stats client went away: %s", strerror(errno));
+			return TRUE;
+		}
+		client->off += rc;
+	}
+	return TRUE;
+}
+
+static gboolean
+stats_client_write(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	stats_client_t *client = data;
+
+	if (stats_client_send(client) == FALSE) {
+		return TRUE;
+	}
+	client->watch_id = 0;	/* removed by returning FALSE */
+	stats_client_free(client);
+	return FALSE;
+}
+
+static gboolean
+stats_client_expire(gpointer data)
+{
+	stats_client_t *client = data;
+
+	client->timer_id = 0;
+	crm_debug("stats client read %lu of %lu bytes in %dms, dropped",
+		(unsigned long)client->off, (unsigned long)client->out->len, STATS_SEND_WAIT);
+	stats_client_free(client);
+	return FALSE;
+}
+
+static void
+stats_client_answer(stats_client_t *client)
+{
+	client->request[client->len] = '\0';
+	client->request[strcspn(client->request, "\r\n")] = '\0';
+
+	client->out = g_string_sized_new(1024);
+	stats_report(client->request, client->out);
+
+	if (client->timer_id != 0) {
+		g_source_remove(client->timer_id);
+		client->timer_id = 0;
+	}
+	g_source_remove(client->watch_id);
+	client->watch_id = 0;
+
+	if (stats_client_send(client)) {
+		stats_client_free(client);
+		return;
+	}
+	client->watch_id = g_io_add_watch(client->channel, G_IO_OUT | G_IO_HUP | G_IO_ERR,
+		stats_client_write, client);
+	client->timer_id = g_timeout_add(STATS_SEND_WAIT, stats_client_expire, client);
+}
+
+static gboolean
+stats_client_timeout(gpointer data)
+{
+	stats_client_t *client = data;
+
+	client->timer_id = 0;
+	client->len = 0;
+	stats_client_answer(client);
+	return FALSE;
+}
+
+static gboolean
+stats_client_read(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	stats_client_t *client = data;
+	ssize_t rc;
+
+	rc = recv(client->fd, client->request + client->len,
+		sizeof(client->request) - 1 - client->len, MSG_DONTWAIT);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return TRUE;
+	}
+	if (rc > 0) {
+		client->len += rc;
+		if (memchr(client->request, '\n', client->len) == NULL
+		    && client->len < sizeof(client->request) - 1) {
+			return TRUE;
+		}
+	}
+	/* a full line, end of file or an error */
+	stats_client_answer(client);
+	return TRUE;
+}
+
+static gboolean
+diskd_stats_accept(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	stats_client_t *client;
+	int fd;
+
+	fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			crm_perror(LOG_WARNING, "accept on %s", stats_path);
+		}
+		return TRUE;
+	}
+
+	client = calloc(1, sizeof(stats_client_t));
+	if (client == NULL) {
+		close(fd);
+		return TRUE;
+	}
+	client->fd = fd;
+	client->channel = g_io_channel_unix_new(fd);
+	client->watch_id = g_io_add_watch(client->channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+		stats_client_read, client);
+	client->timer_id = g_timeout_add(STATS_REQUEST_WAIT, stats_client_timeout, client);
+	return TRUE;
+}
+
+/*
+ * Replace the file at path with text. Readers (e.g. the textfile
+ * collector of the node exporter) see either the old or the new content.
+ */
+gboolean
+diskd_stats_write_file(const char *path, const GString *text)
+{
+	char *tmp = g_strdup_printf("%s.tmp", path);
+	gsize off = 0;
+	ssize_t rc = 0;
+	int fd;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		crm_perror(LOG_WARNING, "%s", tmp);
+		g_free(tmp);
+		return FALSE;
+	}
+	while (off < text->len) {
+		rc = write(fd, text->str + off, text->len - off);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
+			break;
+		}
+		off += rc;
+	}
+	if (close(fd) < 0 || off < text->len || rename(tmp, path) < 0) {
+		crm_perror(LOG_WARNING, "Could not write %s", path);
+		unlink(tmp);
+		g_free(tmp);
+		return FALSE;
+	}
+	g_free(tmp);
+	return TRUE;
+}
+
+/*
+ * Client side (diskd -Q): send request to the socket at path and append
+ * the answer to out. Returns FALSE when diskd does not answer within
+ * timeout seconds.
+ */
+gboolean
+diskd_stats_query(const char *path, const char *request, int timeout, GString *out)
+{
+	struct sockaddr_un addr;
+	struct timeval tv;
+	char buf[4096];
+	ssize_t rc;
+	gboolean answered = FALSE;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return FALSE;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return FALSE;
+	}
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || send(fd, request, strlen(request), MSG_NOSIGNAL) < 0
+	    || send(fd, "\n", 1, MSG_NOSIGNAL) < 0) {
+		close(fd);
+		return FALSE;
+	}
+
+	while ((rc = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		g_string_append_len(out, buf, rc);
+		answered = TRUE;
+	}
+	close(fd);
+	return (rc == 0 && answered);
+}
+
+gboolean
+diskd_stats_listen(const char *path, diskd_stats_report_fn_t fn)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		crm_err("stats socket path %s is too long", path);
+		return FALSE;
+	}
+
+	stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (stats_fd < 0) {
+		crm_perror(LOG_ERR, "stats socket");
+		return FALSE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(stats_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || chmod(path, S_IRUSR | S_IWUSR) < 0
+	    || listen(stats_fd, 8) < 0) {
+		crm_perror(LOG_ERR, "stats socket %s", path);
+		close(stats_fd);
+		stats_fd = -1;
+		return FALSE;
+	}
+
+	stats_path = strdup(path);
+	stats_report = fn;
+	stats_channel = g_io_channel_unix_new(stats_fd);
+	stats_watch_id = g_io_add_watch(stats_channel, G_IO_IN, diskd_stats_accept, NULL);
+	crm_info("stats socket: %s", path);
+	return TRUE;
+}
+
+void
+diskd_stats_close(void)
+{
+	if (stats_watch_id != 0) {
+		g_source_remove(stats_watch_id);
+		stats_watch_id = 0;
+	}
+	if (stats_channel != NULL) {
+		g_io_channel_unref(stats_channel);
+		stats_channel = NULL;
+	}
+	if (stats_fd >= 0) {
+		close(stats_fd);
+		stats_fd = -1;
+		unlink(stats_path);
+	}
+	free(stats_path);
+	stats_path = NULL;
+}
@@ -0,0 +1,78 @@
+/* -------------------------------------------------------------------------
+ * diskd --- monitors shared disk.
+ *   disk check latency statistics.
+ *
+ * Copyright (c) 2008 NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * -------------------------------------------------------------------------
+ */
+#ifndef DISKD_STATS_H
+#define DISKD_STATS_H
+
+#include <glib.h>
+
+/* phase of a disk check */
+#define DISKD_LAT_OPEN		0	/* open() of the device or the probe file */
+#define DISKD_LAT_IO		1	/* the read or write itself */
+#define DISKD_LAT_TOTAL		2	/* whole check including retries */
+#define DISKD_LAT_VERIFY	3	/* read back of a verified write */
+#define DISKD_LAT_PHASES	4
+
+/*
+ * Log-bucketed histogram of microseconds, four buckets per power of two
+ * (relative error <= 25%), up to about 19 hours.
+ */
+#define DISKD_HIST_BUCKETS	144
+
+#define DISKD_STATS_WINDOW	300	/* sliding window [s] */
+#define DISKD_STATS_SLOTS	5	/* the window is made of this many slots */
+
+typedef struct diskd_hist_s {
+	guint32 count[DISKD_HIST_BUCKETS];
+	guint64 n;
+	gint64 max;
+	gint64 sum;
+} diskd_hist_t;
+
+typedef struct diskd_lat_s {
+	diskd_hist_t cumulative;
+	diskd_hist_t window[DISKD_STATS_SLOTS];
+	gint64 epoch[DISKD_STATS_SLOTS];	/* slot number held by window[] */
+} diskd_lat_t;
+
+typedef struct diskd_lat_summary_s {
+	guint64 n;
+	gint64 p50;
+	gint64 p99;
+	gint64 p999;
+	gint64 max;
+} diskd_lat_summary_t;
+
+/* request: the line sent by the client, "" when it sent none */
+typedef void (*diskd_stats_report_fn_t)(const char *request, GString *out);
+
+extern const char *diskd_lat_phase_name(int phase);
+extern void diskd_lat_record(diskd_lat_t *lat, gint64 usec);
+extern void diskd_lat_summary(const diskd_lat_t *lat, gboolean window, diskd_lat_summary_t *sum);
+extern guint64 diskd_hist_count_le(const diskd_hist_t *hist, gint64 usec);
+
+extern gboolean diskd_stats_listen(const char *path, diskd_stats_report_fn_t fn);
+extern void diskd_stats_close(void);
+extern gboolean diskd_stats_write_file(const char *path, const GString *text);
+extern gboolean diskd_stats_query(const char *path, const char *request, int timeout, GString *out);
+
+#endif /* DISKD_STATS_H */